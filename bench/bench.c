@@ -0,0 +1,478 @@
+/* Multithreaded allocator benchmarks, memorylib against glibc malloc
+ * Build with make, run with make bench or
+ * LD_LIBRARY_PATH=memorylib ./bench/bench [-t max_threads] [-s seconds] [workload...]
+ * Every workload runs for seconds with 1, 2, 4, ... max_threads threads, once
+ * with malloc/free and once with my_malloc/my_free, each run in its own
+ * process so that its peak RSS is its own
+ * Reports the malloc and free calls per second, the peak RSS of the process
+ * and the latency percentiles of every LATENCY_STRIDE call
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include "../memorylib/memory.h"
+
+#define MAX_THREADS 64
+#define LATENCY_STRIDE 64								// Must be a power of two
+#define LATENCY_SAMPLES 16384						// Per thread, must be a power of two
+
+struct allocator {
+	const char *name;
+	void *(*malloc)(size_t size);
+	void (*free)(void *ptr);
+};
+struct allocator allocators[] = {
+	{ "glibc", malloc, free },
+	{ "memorylib", my_malloc, my_free },
+};
+#define ALLOCATORS (sizeof(allocators) / sizeof(allocators[0]))
+struct allocator *allocator;
+
+struct worker {
+	int id;
+	int threads;
+	unsigned int seed;
+	unsigned long ops;								// malloc and free calls
+	unsigned long samples;						// Latencies ever sampled
+	unsigned int latency[LATENCY_SAMPLES];	// ns, the last LATENCY_SAMPLES
+	void *state;											// Of the workload
+} __attribute__((aligned(64)));
+struct worker workers[MAX_THREADS];
+
+volatile int stop = 0;
+
+struct result {
+	double ops_per_sec;
+	unsigned int p50, p99, p999;
+};
+
+static unsigned long long now_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+// Every LATENCY_STRIDE call is timed
+static inline void *bench_malloc(struct worker *w, size_t size) {
+	if ((w->ops++ & (LATENCY_STRIDE - 1)) != 0) {
+		return allocator->malloc(size);
+	}
+	unsigned long long start = now_ns();
+	void *ptr = allocator->malloc(size);
+	w->latency[w->samples++ & (LATENCY_SAMPLES - 1)] = now_ns() - start;
+	return ptr;
+}
+
+static inline void bench_free(struct worker *w, void *ptr) {
+	if ((w->ops++ & (LATENCY_STRIDE - 1)) != 0) {
+		allocator->free(ptr);
+		return;
+	}
+	unsigned long long start = now_ns();
+	allocator->free(ptr);
+	w->latency[w->samples++ & (LATENCY_SAMPLES - 1)] = now_ns() - start;
+}
+
+/**
+ * Larson: every thread replaces random objects of 8B to 1KB in its array,
+ * after LARSON_ROUND replacements it starts a new thread that takes the array
+ * over and exits, so objects are freed by other threads than the ones that
+ * allocated them and threads come and go all the time
+ */
+#define LARSON_OBJECTS 1000
+#define LARSON_ROUND 10000
+volatile int larson_done = 0;
+
+void *th_bench_larson(struct worker *w) {
+	void **obj = (void**)w->state;
+	if (obj == NULL) {
+		obj = (void**)calloc(LARSON_OBJECTS, sizeof(void*));
+		w->state = obj;
+		for (int i = 0; i < LARSON_OBJECTS; i++) {
+			obj[i] = bench_malloc(w, 8 + rand_r(&w->seed) % 1017);
+		}
+	}
+
+	for (int i = 0; i < LARSON_ROUND; i++) {
+		int slot = rand_r(&w->seed) % LARSON_OBJECTS;
+		bench_free(w, obj[slot]);
+		obj[slot] = bench_malloc(w, 8 + rand_r(&w->seed) % 1017);
+		*(char*)obj[slot] = 1;
+	}
+
+	if (!stop) {
+		pthread_t next;
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+		if (pthread_create(&next, &attr, (void*)th_bench_larson, w) != 0) {
+			perror("pthread_create\n");
+			exit(1);
+		}
+		pthread_attr_destroy(&attr);
+		return NULL;
+	}
+
+	for (int i = 0; i < LARSON_OBJECTS; i++) {
+		bench_free(w, obj[i]);
+	}
+	free(obj);
+	__sync_fetch_and_add(&larson_done, 1);
+	return NULL;
+}
+
+/**
+ * Threadtest: every thread allocates THREADTEST_OBJECTS objects of 64B and
+ * frees them all, over and over
+ */
+#define THREADTEST_OBJECTS 10000
+
+void *th_bench_threadtest(struct worker *w) {
+	void **obj = (void**)malloc(THREADTEST_OBJECTS * sizeof(void*));
+
+	while (!stop) {
+		for (int i = 0; i < THREADTEST_OBJECTS; i++) {
+			obj[i] = bench_malloc(w, 64);
+			*(char*)obj[i] = 1;
+		}
+		for (int i = 0; i < THREADTEST_OBJECTS; i++) {
+			bench_free(w, obj[i]);
+		}
+	}
+	free(obj);
+	return NULL;
+}
+
+/**
+ * Xmalloc: every thread allocates batches of XMALLOC_BATCH objects of 16B to
+ * 1KB and hands them to the next thread, that frees them, so all the objects
+ * are freed remotely, with one thread it frees its own batches
+ * The batch array is allocated with the objects
+ */
+#define XMALLOC_BATCH 128
+
+struct mailbox {
+	void **volatile batch;
+} __attribute__((aligned(64)));
+struct mailbox mailboxes[MAX_THREADS];
+
+void xmalloc_drain(struct worker *w, struct mailbox *mailbox) {
+	void **batch = (void**)__sync_lock_test_and_set(&mailbox->batch, NULL);
+	if (batch == NULL) {
+		return;
+	}
+	for (int i = 0; i < XMALLOC_BATCH; i++) {
+		bench_free(w, batch[i]);
+	}
+	bench_free(w, batch);
+}
+
+void *th_bench_xmalloc(struct worker *w) {
+	struct mailbox *own = &mailboxes[w->id];
+	struct mailbox *next = &mailboxes[(w->id + 1) % w->threads];
+
+	while (!stop) {
+		void **batch = (void**)bench_malloc(w, XMALLOC_BATCH * sizeof(void*));
+		for (int i = 0; i < XMALLOC_BATCH; i++) {
+			batch[i] = bench_malloc(w, 16 << (rand_r(&w->seed) % 7));
+			*(char*)batch[i] = 1;
+		}
+		// Wait for the next thread to take the previous batch
+		while (!__sync_bool_compare_and_swap(&next->batch, NULL, batch)) {
+			xmalloc_drain(w, own);
+			sched_yield();
+		}
+		xmalloc_drain(w, own);
+	}
+	xmalloc_drain(w, own);
+	return NULL;
+}
+
+/**
+ * Cache-scratch: the main thread allocates one small object for every thread,
+ * every thread frees its object and then allocates, writes and frees small
+ * objects, an allocator that gives a thread memory next to the objects of
+ * other threads makes them share cache lines
+ */
+#define SCRATCH_WRITES 1000
+void *scratch_obj[MAX_THREADS];
+
+void *th_bench_scratch(struct worker *w) {
+	bench_free(w, scratch_obj[w->id]);
+
+	while (!stop) {
+		volatile char *obj = (volatile char*)bench_malloc(w, 8);
+		for (int i = 0; i < SCRATCH_WRITES; i++) {
+			obj[i % 8]++;
+		}
+		bench_free(w, (void*)obj);
+	}
+	return NULL;
+}
+
+/**
+ * Large churn: every thread keeps a window of buffers between 4KB and 1MB
+ * and replaces a random one, touching its first and last byte
+ */
+#define LARGE_WINDOW 16
+
+void *th_bench_large(struct worker *w) {
+	void *window[LARGE_WINDOW] = { NULL };
+
+	while (!stop) {
+		int slot = rand_r(&w->seed) % LARGE_WINDOW;
+		size_t size = (4096UL << (rand_r(&w->seed) % 9)) - rand_r(&w->seed) % 4096;
+		if (window[slot] != NULL) {
+			bench_free(w, window[slot]);
+		}
+		window[slot] = bench_malloc(w, size);
+		((char*)window[slot])[0] = 1;
+		((char*)window[slot])[size - 1] = 1;
+	}
+	for (int i = 0; i < LARGE_WINDOW; i++) {
+		if (window[i] != NULL) {
+			bench_free(w, window[i]);
+		}
+	}
+	return NULL;
+}
+
+/**
+ * Random sizes: every thread keeps a window of RANDOM_WINDOW objects and
+ * replaces a random one, most objects are small and a few are large
+ *   60% 8B to 64B, 25% to 512B, 10% to 2KB, 4% to 32KB, 1% to 256KB
+ */
+#define RANDOM_WINDOW 4096
+
+size_t random_size(unsigned int *seed) {
+	int bucket = rand_r(seed) % 100;
+	if (bucket < 60)
+		return 8 + rand_r(seed) % 57;
+	if (bucket < 85)
+		return 65 + rand_r(seed) % 448;
+	if (bucket < 95)
+		return 513 + rand_r(seed) % 1536;
+	if (bucket < 99)
+		return 2049 + rand_r(seed) % 30720;
+	return 32769 + rand_r(seed) % 229376;
+}
+
+void *th_bench_random(struct worker *w) {
+	void **window = (void**)calloc(RANDOM_WINDOW, sizeof(void*));
+
+	while (!stop) {
+		int slot = rand_r(&w->seed) % RANDOM_WINDOW;
+		if (window[slot] != NULL) {
+			bench_free(w, window[slot]);
+		}
+		window[slot] = bench_malloc(w, random_size(&w->seed));
+		*(char*)window[slot] = 1;
+	}
+	for (int i = 0; i < RANDOM_WINDOW; i++) {
+		if (window[i] != NULL) {
+			bench_free(w, window[i]);
+		}
+	}
+	free(window);
+	return NULL;
+}
+
+struct workload {
+	const char *name;
+	void *(*run)(struct worker *w);
+};
+struct workload workloads[] = {
+	{ "larson", th_bench_larson },
+	{ "threadtest", th_bench_threadtest },
+	{ "xmalloc", th_bench_xmalloc },
+	{ "cache-scratch", th_bench_scratch },
+	{ "large-churn", th_bench_large },
+	{ "random-sizes", th_bench_random },
+};
+#define WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+int compare_latency(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int*)a, y = *(const unsigned int*)b;
+	return (x > y) - (x < y);
+}
+
+// Runs the workload with threads threads for seconds, in the child process
+struct result run_workload(struct workload *workload, int threads,
+	double seconds) {
+	pthread_t pthreads[MAX_THREADS];
+	struct result result;
+
+	for (int i = 0; i < threads; i++) {
+		workers[i].id = i;
+		workers[i].threads = threads;
+		workers[i].seed = i + 1;
+		workers[i].ops = 0;
+		workers[i].samples = 0;
+		workers[i].state = NULL;
+	}
+	if (workload->run == th_bench_scratch) {
+		for (int i = 0; i < threads; i++) {
+			scratch_obj[i] = allocator->malloc(8);
+		}
+	}
+
+	unsigned long long start = now_ns();
+	for (int i = 0; i < threads; i++) {
+		if (pthread_create(&pthreads[i], NULL, (void*)workload->run,
+			&workers[i]) != 0) {
+			perror("pthread_create\n");
+			exit(1);
+		}
+	}
+
+	struct timespec duration;
+	duration.tv_sec = (time_t)seconds;
+	duration.tv_nsec = (seconds - duration.tv_sec) * 1e9;
+	nanosleep(&duration, NULL);
+	stop = 1;
+
+	for (int i = 0; i < threads; i++) {
+		pthread_join(pthreads[i], NULL);
+	}
+	// The larson threads pass the work on to new threads
+	if (workload->run == th_bench_larson) {
+		while (larson_done != threads) {
+			sched_yield();
+		}
+	}
+	double time = (now_ns() - start) / 1e9;
+
+	if (workload->run == th_bench_xmalloc) {
+		for (int i = 0; i < threads; i++) {
+			xmalloc_drain(&workers[i], &mailboxes[i]);
+		}
+	}
+
+	// Merge the sampled latencies of all the threads
+	static unsigned int latency[MAX_THREADS * LATENCY_SAMPLES];
+	unsigned long ops = 0, samples = 0;
+	for (int i = 0; i < threads; i++) {
+		unsigned long n = workers[i].samples < LATENCY_SAMPLES ?
+			workers[i].samples : LATENCY_SAMPLES;
+		memcpy(&latency[samples], workers[i].latency, n * sizeof(unsigned int));
+		samples += n;
+		ops += workers[i].ops;
+	}
+	qsort(latency, samples, sizeof(unsigned int), compare_latency);
+
+	result.ops_per_sec = ops / time;
+	result.p50 = samples > 0 ? latency[samples / 2] : 0;
+	result.p99 = samples > 0 ? latency[samples * 99 / 100] : 0;
+	result.p999 = samples > 0 ? latency[samples * 999 / 1000] : 0;
+	return result;
+}
+
+// Runs the workload in a child process, so peak RSS is the workload's
+void bench(struct workload *workload, struct allocator *alloc, int threads,
+	double seconds) {
+	int fd[2];
+	if (pipe(fd) == -1) {
+		perror("pipe\n");
+		exit(1);
+	}
+
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == -1) {
+		perror("fork\n");
+		exit(1);
+	}
+	if (pid == 0) {
+		close(fd[0]);
+		// The result goes through the pipe, hide what a debug memorylib prints
+		int null = open("/dev/null", O_WRONLY);
+		if (null != -1) {
+			dup2(null, STDOUT_FILENO);
+			close(null);
+		}
+		allocator = alloc;
+		struct result result = run_workload(workload, threads, seconds);
+		if (write(fd[1], &result, sizeof(result)) != sizeof(result)) {
+			_exit(1);
+		}
+		_exit(0);
+	}
+
+	close(fd[1]);
+	struct result result;
+	int got = read(fd[0], &result, sizeof(result)) == sizeof(result);
+	close(fd[0]);
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+	if (!got || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("%7d  %-10s  failed\n", threads, alloc->name);
+		return;
+	}
+
+	printf("%7d  %-10s  %9.2f  %13.1f  %8u  %8u  %10u\n", threads, alloc->name,
+		result.ops_per_sec / 1e6, usage.ru_maxrss / 1024.0, result.p50, result.p99,
+		result.p999);
+}
+
+int main(int argc, char *argv[]) {
+	int max_threads = sysconf(_SC_NPROCESSORS_ONLN);
+	double seconds = 1;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:s:")) != -1) {
+		if (opt == 't') {
+			max_threads = atoi(optarg);
+		}
+		else if (opt == 's') {
+			seconds = atof(optarg);
+		}
+		else {
+			fprintf(stderr, "Usage: %s [-t max_threads] [-s seconds] [workload...]\n",
+				argv[0]);
+			return 1;
+		}
+	}
+	if (max_threads < 1 || max_threads > MAX_THREADS || seconds <= 0) {
+		fprintf(stderr, "%s: threads must be 1 to %d and seconds positive\n",
+			argv[0], MAX_THREADS);
+		return 1;
+	}
+
+	for (unsigned int i = 0; i < WORKLOADS; i++) {
+		if (optind < argc) {
+			int selected = 0;
+			for (int j = optind; j < argc; j++) {
+				selected |= strcmp(argv[j], workloads[i].name) == 0;
+			}
+			if (!selected) {
+				continue;
+			}
+		}
+
+		printf("---------- %s ----------\n", workloads[i].name);
+		printf("%7s  %-10s  %9s  %13s  %8s  %8s  %10s\n", "threads", "allocator",
+			"Mops/s", "peak RSS (MB)", "p50 (ns)", "p99 (ns)", "p99.9 (ns)");
+		// 1, 2, 4, ... and max_threads
+		int threads = 1;
+		while (1) {
+			for (unsigned int j = 0; j < ALLOCATORS; j++) {
+				bench(&workloads[i], &allocators[j], threads, seconds);
+			}
+			if (threads == max_threads) {
+				break;
+			}
+			threads = threads * 2 < max_threads ? threads * 2 : max_threads;
+		}
+	}
+
+	return 0;
+}
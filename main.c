@@ -8,6 +8,12 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <sys/wait.h>
+#include <signal.h>
 #include "memorylib/memory.h"
 
 #define ARRAY_SIZE 65
@@ -91,20 +97,19 @@ void test_cmp_swap_rem_free() {
 
 /**
  * This function tests the local and the global cache
- * Firstly 129 objects get allocated
+ * Firstly 255 objects get allocated, a pg_block holds 127 2048B objects
  * this results to 2 full pg_blocks and a pg_block with just one object
  * To test the local cache first
  * The one object gets freed and another malloc is called
  * We see the effect in the local_cache output
  * To test the global cache first
  * All the objects gets freed
- * This results to 1 pg_block cached in local_cache and 1 global cache
- * The 3rd pg_block returns to the OS
- * Then we allocate again 129 objects
+ * This results to 1 pg_block cached in local_cache and 2 in global cache
+ * Then we allocate again 255 objects
  * We see the effects in the local_cache and global_cache output
  */
 void test_cache() {
-	int array_size = 129;
+	int array_size = 255;
 	int malloc_size = 2048;
 
 	void *my_array[array_size];
@@ -113,7 +118,7 @@ void test_cache() {
 		my_array[i] = my_malloc(malloc_size);
 	}
 
-	printf("Malloc 129 obj, 2 full pg_blocks and 1 with just 1 obj\n");
+	printf("Malloc 255 obj, 2 full pg_blocks and 1 with just 1 obj\n");
 	print_less_heap();
 	print_local_cache();
 	print_global_cache();
@@ -136,7 +141,7 @@ void test_cache() {
 		my_free(my_array[i]);
 	}
 
-	printf("Free 129 objs\n");
+	printf("Free 255 objs\n");
 	print_less_heap();
 	print_local_cache();
 	print_global_cache();
@@ -145,7 +150,7 @@ void test_cache() {
 		my_array[i] = my_malloc(malloc_size);
 	}
 
-	printf("Malloc 129 objs\n");
+	printf("Malloc 255 objs\n");
 	print_less_heap();
 	print_local_cache();
 	print_global_cache();
@@ -240,10 +245,10 @@ void th_test_large_obj(int *id) {
 		for (int i = 0; i < 100000; i++) {
 			my_array_test_large_obj[i] = my_malloc(malloc_size);
 		}
-		print_large_obj_table();
+		print_large_objs();
 		th0_ready = 1;
 		sleep(2);
-		print_large_obj_table();
+		print_large_objs();
 	}
 	else {
 		while (th0_ready == 0) {}
@@ -273,6 +278,899 @@ void test_large_obj() {
 	}
 }
 
+/**
+ * This function measures large object churn
+ * Every thread keeps a window of live buffers between 4KB and 1MB and
+ * replaces a random one on every iteration, touching the first and the last
+ * byte of the new buffer
+ * The same sequence runs once with my_malloc/my_free and once with a plain
+ * mmap/munmap per buffer, which is what the large object path used to do
+ * @param id [range from 0 to pthread_num - 1]
+ */
+#define CHURN_WINDOW 64
+#define CHURN_ITERATIONS 100000
+int churn_use_mmap = 0;
+
+void th_test_large_obj_churn(int *id) {
+	void *window[CHURN_WINDOW] = { NULL };
+	size_t window_size[CHURN_WINDOW] = { 0 };
+	unsigned int seed = *id + 1;
+
+	for (int i = 0; i < CHURN_ITERATIONS; i++) {
+		int slot = rand_r(&seed) % CHURN_WINDOW;
+		// Sizes are spread evenly over the powers of two from 4KB to 1MB
+		size_t size = (4096UL << (rand_r(&seed) % 9)) - rand_r(&seed) % 4096;
+
+		if (window[slot] != NULL) {
+			if (churn_use_mmap)
+				munmap(window[slot], window_size[slot] + 16);
+			else
+				my_free(window[slot]);
+		}
+
+		if (churn_use_mmap)
+			window[slot] = mmap(NULL, size + 16, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		else
+			window[slot] = my_malloc(size);
+		window_size[slot] = size;
+		((char*)window[slot])[0] = 1;
+		((char*)window[slot])[size - 1] = 1;
+	}
+
+	for (int i = 0; i < CHURN_WINDOW; i++) {
+		if (churn_use_mmap)
+			munmap(window[i], window_size[i] + 16);
+		else
+			my_free(window[i]);
+	}
+}
+
+double run_large_obj_churn(int pthread_num) {
+	pthread_t pthreads[pthread_num];
+	int id[pthread_num];
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < pthread_num; i++) {
+		id[i] = i;
+		if (pthread_create(&pthreads[i], NULL, (void*)th_test_large_obj_churn,	&id[i]) != 0) {
+			perror("pthread_create\n");
+			exit(1);
+		}
+	}
+
+	for (int i = 0; i < pthread_num; i++) {
+		pthread_join(pthreads[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void test_large_obj_churn() {
+	int pthread_nums[] = { 1, 4 };
+
+	for (int i = 0; i < 2; i++) {
+		churn_use_mmap = 1;
+		double mmap_time = run_large_obj_churn(pthread_nums[i]);
+		churn_use_mmap = 0;
+		double my_time = run_large_obj_churn(pthread_nums[i]);
+
+		printf("threads: %d, mmap/munmap: %.3fs, my_malloc/my_free: %.3fs, speedup: %.2fx\n",
+			pthread_nums[i], mmap_time, my_time, mmap_time / my_time);
+	}
+	print_large_objs();
+}
+
+/**
+ * This function reports the fragmentation for a realistic size distribution
+ * 500000 small objects are allocated and written, their sizes are
+ * 50% 1-64B, 30% 65-256B, 15% 257-1024B and 5% 1025-2048B
+ * Then the RSS growth is compared to the requested bytes
+ * Then 3 out of 4 objects are freed at random and the rest churn, every
+ * iteration frees a random live object or allocates a new one in a free slot,
+ * keeping about a quarter of them live, and the RSS is reported again
+ */
+#define FRAGMENTATION_OBJECTS 500000
+#define FRAGMENTATION_CHURN 5000000
+void *my_array_test_fragmentation[FRAGMENTATION_OBJECTS];
+size_t my_array_test_fragmentation_size[FRAGMENTATION_OBJECTS];
+
+size_t fragmentation_size(unsigned int *seed) {
+	int bucket = rand_r(seed) % 100;
+	if (bucket < 50)
+		return 1 + rand_r(seed) % 64;
+	else if (bucket < 80)
+		return 65 + rand_r(seed) % 192;
+	else if (bucket < 95)
+		return 257 + rand_r(seed) % 768;
+	else
+		return 1025 + rand_r(seed) % 1024;
+}
+
+long get_rss() {
+	long pages = 0, rss = 0;
+	FILE *statm = fopen("/proc/self/statm", "r");
+	if (statm == NULL || fscanf(statm, "%ld %ld", &pages, &rss) != 2) {
+		perror("statm\n");
+		exit(1);
+	}
+	fclose(statm);
+	return rss * sysconf(_SC_PAGESIZE);
+}
+
+void test_fragmentation() {
+	unsigned int seed = 1;
+	size_t requested = 0;
+
+	// Touch the bookkeeping before measuring
+	memset(my_array_test_fragmentation_size, 0,
+		sizeof(my_array_test_fragmentation_size));
+	long rss_start = get_rss();
+	for (int i = 0; i < FRAGMENTATION_OBJECTS; i++) {
+		size_t size = fragmentation_size(&seed);
+		my_array_test_fragmentation[i] = my_malloc(size);
+		my_array_test_fragmentation_size[i] = size;
+		memset(my_array_test_fragmentation[i], 1, size);
+		requested += size;
+	}
+	long rss = get_rss() - rss_start;
+
+	printf("requested: %zu KB, rss: %ld KB, overhead: %.1f%%\n",
+		requested / 1024, rss / 1024, 100.0 * (rss - (long)requested) / requested);
+
+	for (int i = 0; i < FRAGMENTATION_OBJECTS; i++) {
+		if (rand_r(&seed) % 4 != 0) {
+			my_free(my_array_test_fragmentation[i]);
+			my_array_test_fragmentation[i] = NULL;
+			requested -= my_array_test_fragmentation_size[i];
+		}
+	}
+	for (int i = 0; i < FRAGMENTATION_CHURN; i++) {
+		int slot = rand_r(&seed) % FRAGMENTATION_OBJECTS;
+		if (my_array_test_fragmentation[slot] != NULL) {
+			my_free(my_array_test_fragmentation[slot]);
+			my_array_test_fragmentation[slot] = NULL;
+			requested -= my_array_test_fragmentation_size[slot];
+		}
+		else if (rand_r(&seed) % 3 == 0) {
+			size_t size = fragmentation_size(&seed);
+			my_array_test_fragmentation[slot] = my_malloc(size);
+			my_array_test_fragmentation_size[slot] = size;
+			memset(my_array_test_fragmentation[slot], 1, size);
+			requested += size;
+		}
+	}
+	rss = get_rss() - rss_start;
+
+	printf("after churn, live: %zu KB, rss: %ld KB, overhead: %.1f%%\n",
+		requested / 1024, rss / 1024, 100.0 * (rss - (long)requested) / requested);
+
+	for (int i = 0; i < FRAGMENTATION_OBJECTS; i++) {
+		my_free(my_array_test_fragmentation[i]);
+	}
+}
+
+/**
+ * This function measures the throughput of a producer/consumer pipeline,
+ * where every object is freed remotely
+ * Every producer allocates objects of 16B to 256B and passes them through a
+ * ring to its consumer, that writes and frees them
+ */
+#define PIPELINE_PAIRS 2
+#define PIPELINE_OBJECTS 2000000
+#define PIPELINE_RING 1024
+
+struct pipeline_ring {
+	void *obj[PIPELINE_RING];
+	volatile unsigned long head;		// Written by the producer
+	volatile unsigned long tail;		// Written by the consumer
+};
+struct pipeline_ring pipeline_rings[PIPELINE_PAIRS];
+
+void th_test_pipeline_producer(int *id) {
+	struct pipeline_ring *ring = &pipeline_rings[*id];
+	unsigned int seed = *id + 1;
+
+	for (unsigned long i = 0; i < PIPELINE_OBJECTS; i++) {
+		while (ring->head - ring->tail == PIPELINE_RING)
+			sched_yield();
+		ring->obj[i % PIPELINE_RING] = my_malloc(16 << (rand_r(&seed) % 5));
+		__sync_synchronize();
+		ring->head = i + 1;
+	}
+}
+
+void th_test_pipeline_consumer(int *id) {
+	struct pipeline_ring *ring = &pipeline_rings[*id];
+
+	for (unsigned long i = 0; i < PIPELINE_OBJECTS; i++) {
+		while (ring->head == i)
+			sched_yield();
+		__sync_synchronize();
+		void *obj = ring->obj[i % PIPELINE_RING];
+		*(char*)obj = 1;
+		my_free(obj);
+		ring->tail = i + 1;
+	}
+}
+
+void test_pipeline() {
+	pthread_t producers[PIPELINE_PAIRS], consumers[PIPELINE_PAIRS];
+	int id[PIPELINE_PAIRS];
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < PIPELINE_PAIRS; i++) {
+		id[i] = i;
+		if (pthread_create(&producers[i], NULL, (void*)th_test_pipeline_producer, &id[i]) != 0 ||
+			pthread_create(&consumers[i], NULL, (void*)th_test_pipeline_consumer, &id[i]) != 0) {
+			perror("pthread_create\n");
+			exit(1);
+		}
+	}
+
+	for (int i = 0; i < PIPELINE_PAIRS; i++) {
+		pthread_join(producers[i], NULL);
+		pthread_join(consumers[i], NULL);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	double time = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+	printf("pairs: %d, objects: %d, time: %.3fs, throughput: %.2f Mobj/s\n",
+		PIPELINE_PAIRS, PIPELINE_PAIRS * PIPELINE_OBJECTS, time,
+		PIPELINE_PAIRS * PIPELINE_OBJECTS / time / 1e6);
+}
+
+/**
+ * This function checks my_aligned_alloc and reports its memory overhead
+ * For every pair of allignment and size, up to 16MB of objects are
+ * allocated, checked for their allignment and written, then the RSS growth
+ * is compared to the requested bytes
+ * Nothing is freed until the end, so no pair reuses the memory of another
+ */
+#define ALIGNED_PAIRS 6
+#define ALIGNED_BYTES (16 << 20)
+#define ALIGNED_MAX_OBJECTS 16384
+void *my_array_test_aligned[ALIGNED_PAIRS][ALIGNED_MAX_OBJECTS];
+
+void test_aligned() {
+	size_t allignments[ALIGNED_PAIRS] = { 64, 64, 512, 4096, 4096, 65536 };
+	size_t sizes[ALIGNED_PAIRS] = { 64, 200, 1500, 4096, 100000, 65536 };
+	int objects[ALIGNED_PAIRS];
+
+	for (int i = 0; i < ALIGNED_PAIRS; i++) {
+		objects[i] = ALIGNED_BYTES / sizes[i];
+		if (objects[i] > ALIGNED_MAX_OBJECTS)
+			objects[i] = ALIGNED_MAX_OBJECTS;
+
+		long rss_start = get_rss();
+		for (int j = 0; j < objects[i]; j++) {
+			void *obj = my_aligned_alloc(allignments[i], sizes[i]);
+			if ((unsigned long)obj % allignments[i] != 0) {
+				printf("my_aligned_alloc: %p is not aligned to %zu\n", obj,
+					allignments[i]);
+				exit(1);
+			}
+			memset(obj, 1, sizes[i]);
+			my_array_test_aligned[i][j] = obj;
+		}
+		long rss = get_rss() - rss_start;
+		size_t requested = objects[i] * sizes[i];
+
+		printf("allignment: %6zu, size: %6zu, objects: %5d, overhead: %.1f%%\n",
+			allignments[i], sizes[i], objects[i],
+			100.0 * (rss - (long)requested) / requested);
+	}
+
+	for (int i = 0; i < ALIGNED_PAIRS; i++) {
+		for (int j = 0; j < objects[i]; j++) {
+			my_free(my_array_test_aligned[i][j]);
+		}
+	}
+}
+
+/**
+ * This function compares my_calloc to my_malloc followed by memset
+ * Small objects of 16B to 256B are allocated in new pg_blocks, then large
+ * sparse tables of 1MB are allocated and only one byte per 64KB is written
+ * Both report the time and the RSS growth
+ */
+#define CALLOC_SMALL_OBJECTS 1000000
+#define CALLOC_TABLES 256
+#define CALLOC_TABLE_SIZE (1 << 20)
+void *my_array_test_calloc[CALLOC_SMALL_OBJECTS];
+void *my_array_test_calloc_tables[CALLOC_TABLES];
+
+void run_calloc(int use_calloc) {
+	struct timespec start, end;
+	unsigned int seed = 1;
+
+	long rss_start = get_rss();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < CALLOC_SMALL_OBJECTS; i++) {
+		size_t size = 16 << (rand_r(&seed) % 5);
+		if (use_calloc) {
+			my_array_test_calloc[i] = my_calloc(1, size);
+		}
+		else {
+			my_array_test_calloc[i] = my_malloc(size);
+			memset(my_array_test_calloc[i], 0, size);
+		}
+	}
+	for (int i = 0; i < CALLOC_TABLES; i++) {
+		char *table;
+		if (use_calloc) {
+			table = my_calloc(CALLOC_TABLE_SIZE, 1);
+		}
+		else {
+			table = my_malloc(CALLOC_TABLE_SIZE);
+			memset(table, 0, CALLOC_TABLE_SIZE);
+		}
+		for (int j = 0; j < CALLOC_TABLE_SIZE; j += 65536)
+			table[j] = 1;
+		my_array_test_calloc_tables[i] = table;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long rss = get_rss() - rss_start;
+
+	printf("%s: %.3fs, rss: %ld KB\n",
+		use_calloc ? "my_calloc        " : "my_malloc+memset ",
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+		rss / 1024);
+
+	for (int i = 0; i < CALLOC_SMALL_OBJECTS; i++) {
+		my_free(my_array_test_calloc[i]);
+	}
+	for (int i = 0; i < CALLOC_TABLES; i++) {
+		my_free(my_array_test_calloc_tables[i]);
+	}
+}
+
+void test_calloc() {
+	// Every run gets its own process, so both start from new memory
+	pid_t pid = fork();
+	if (pid == 0) {
+		run_calloc(0);
+		exit(0);
+	}
+	waitpid(pid, NULL, 0);
+	run_calloc(1);
+}
+
+/**
+ * This function grows log buffers line by line with my_realloc and compares
+ * it to moving them with my_malloc, memcpy and my_free
+ * Every buffer starts small, becomes a large object and grows to
+ * LOG_BUFFER_SIZE, then it's shrunk back to a small object and checked
+ * Both report the time and how many times the buffers moved
+ * At last a huge buffer is shrunk below the limit of the large object cache,
+ * its mapping must go back to the OS
+ */
+#define LOG_BUFFERS 8
+#define LOG_BUFFER_SIZE (8 << 20)
+#define LOG_LINE 100
+#define LOG_GROW 65536
+#define LOG_HUGE (100 << 20)
+#define LOG_HUGE_SHRUNK (500 << 10)
+
+void run_log_buffers(int use_realloc) {
+	struct timespec start, end;
+	char *buffer[LOG_BUFFERS];
+	size_t capacity[LOG_BUFFERS];
+	long moves = 0;
+
+	for (int i = 0; i < LOG_BUFFERS; i++) {
+		buffer[i] = my_malloc(LOG_LINE);
+		capacity[i] = LOG_LINE;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (size_t used = 0; used + LOG_LINE <= LOG_BUFFER_SIZE; used += LOG_LINE) {
+		for (int i = 0; i < LOG_BUFFERS; i++) {
+			if (used + LOG_LINE > capacity[i]) {
+				size_t new_capacity = capacity[i] + LOG_GROW;
+				char *new_buffer;
+				if (use_realloc) {
+					new_buffer = my_realloc(buffer[i], new_capacity);
+				}
+				else {
+					new_buffer = my_malloc(new_capacity);
+					memcpy(new_buffer, buffer[i], used);
+					my_free(buffer[i]);
+				}
+				if (new_buffer != buffer[i])
+					moves++;
+				buffer[i] = new_buffer;
+				capacity[i] = new_capacity;
+			}
+			memset(buffer[i] + used, 'a' + (used / LOG_LINE + i) % 26, LOG_LINE);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	int errors = 0;
+	for (int i = 0; i < LOG_BUFFERS; i++) {
+		buffer[i] = my_realloc(buffer[i], 10 * LOG_LINE);
+		for (size_t used = 0; used < 10 * LOG_LINE; used += LOG_LINE) {
+			if (buffer[i][used] != 'a' + (used / LOG_LINE + i) % 26)
+				errors++;
+		}
+		my_free(buffer[i]);
+	}
+
+	printf("%s: %.3fs, moves: %ld, errors: %d\n",
+		use_realloc ? "my_realloc             " : "my_malloc+memcpy+my_free",
+		(end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+		moves, errors);
+}
+
+void shrink_huge_buffer() {
+	size_t before, after, len = sizeof(size_t);
+	char *buffer = my_malloc(LOG_HUGE);
+	memset(buffer, 'h', LOG_HUGE_SHRUNK);
+	my_mallctl("stats.mapped", &before, &len, NULL, 0);
+	buffer = my_realloc(buffer, LOG_HUGE_SHRUNK);
+	my_mallctl("stats.mapped", &after, &len, NULL, 0);
+
+	int errors = 0;
+	for (int i = 0; i < LOG_HUGE_SHRUNK; i++) {
+		if (buffer[i] != 'h')
+			errors++;
+	}
+	printf("huge buffer shrunk to %dKB: usable %zu, mapped %zuKB -> %zuKB, %s, errors: %d\n",
+		LOG_HUGE_SHRUNK >> 10, my_malloc_usable_size(buffer), before >> 10,
+		after >> 10, after + LOG_HUGE / 2 < before ? "ok" : "FAILED", errors);
+	my_free(buffer);
+}
+
+void test_log_buffers() {
+	run_log_buffers(0);
+	run_log_buffers(1);
+	shrink_huge_buffer();
+}
+
+/**
+ * This function compares my_free to my_free_sized
+ * Objects of 16B to 256B are allocated, shuffled and freed, and then the
+ * same is done freeing them with their size, the best of FREE_SIZED_ROUNDS
+ * rounds of each is printed
+ * At last objects that my_realloc kept in place are freed with their new
+ * size
+ */
+#define FREE_SIZED_OBJECTS 2000000
+#define FREE_SIZED_ROUNDS 5
+void *my_array_test_free_sized[FREE_SIZED_OBJECTS];
+size_t my_array_test_free_sized_size[FREE_SIZED_OBJECTS];
+
+double run_free_sized(int use_size) {
+	struct timespec start, end;
+	unsigned int seed = 1;
+
+	for (int i = 0; i < FREE_SIZED_OBJECTS; i++) {
+		my_array_test_free_sized_size[i] = 16 + rand_r(&seed) % 241;
+		my_array_test_free_sized[i] = my_malloc(my_array_test_free_sized_size[i]);
+	}
+	for (int i = FREE_SIZED_OBJECTS - 1; i > 0; i--) {
+		int j = rand_r(&seed) % (i + 1);
+		void *obj = my_array_test_free_sized[i];
+		size_t size = my_array_test_free_sized_size[i];
+		my_array_test_free_sized[i] = my_array_test_free_sized[j];
+		my_array_test_free_sized_size[i] = my_array_test_free_sized_size[j];
+		my_array_test_free_sized[j] = obj;
+		my_array_test_free_sized_size[j] = size;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < FREE_SIZED_OBJECTS; i++) {
+		if (use_size) {
+			my_free_sized(my_array_test_free_sized[i],
+				my_array_test_free_sized_size[i]);
+		}
+		else {
+			my_free(my_array_test_free_sized[i]);
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void test_free_sized() {
+	double unsized = 0, sized = 0;
+	for (int i = 0; i < FREE_SIZED_ROUNDS; i++) {
+		double time = run_free_sized(0);
+		if (i == 0 || time < unsized)
+			unsized = time;
+		time = run_free_sized(1);
+		if (i == 0 || time < sized)
+			sized = time;
+	}
+	printf("%d objects, best of %d, my_free: %.3fs, my_free_sized: %.3fs\n",
+		FREE_SIZED_OBJECTS, FREE_SIZED_ROUNDS, unsized, sized);
+
+	size_t allocated, len = sizeof(size_t);
+	void *small = my_realloc(my_malloc(200), 150);
+	void *large = my_realloc(my_malloc(100000), 60000);
+	my_free_sized(small, 150);
+	my_free_sized(large, 60000);
+	my_mallctl("stats.allocated", &allocated, &len, NULL, 0);
+	printf("reallocated objects freed with their size, stats.allocated: %zu\n",
+		allocated);
+}
+
+/**
+ * This function runs the pipeline of test 8 and prints the counters of
+ * my_mallctl, then it keeps some small and large objects and prints how
+ * many bytes are allocated
+ */
+#define STATS_OBJECTS 1000
+void *my_array_test_stats[STATS_OBJECTS];
+
+size_t get_stat(const char *name) {
+	size_t value, len = sizeof(value);
+	if (my_mallctl(name, &value, &len, NULL, 0) != 0) {
+		printf("my_mallctl: %s failed\n", name);
+		return 0;
+	}
+	return value;
+}
+
+void test_stats() {
+	const char *names[] = { "stats.allocated", "stats.mapped", "stats.mmaps",
+		"stats.munmaps", "stats.mremaps", "stats.remote_frees",
+		"stats.orphan_adoptions", "stats.local_cache.hits",
+		"stats.local_cache.misses", "stats.global_cache.hits",
+		"stats.global_cache.misses", "stats.large.allocs", "stats.large.frees",
+		"stats.large.allocated", "stats.cas_retries" };
+
+	test_pipeline();
+	for (unsigned int i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		printf("%-26s %zu\n", names[i], get_stat(names[i]));
+	}
+	for (size_t i = 0; i < get_stat("stats.classes"); i++) {
+		char name[64];
+		sprintf(name, "stats.class.%zu.allocs", i);
+		size_t allocs = get_stat(name);
+		if (allocs == 0) {
+			continue;
+		}
+		sprintf(name, "stats.class.%zu.size", i);
+		printf("class %2zu, size %4zu: allocs %zu", i, get_stat(name), allocs);
+		sprintf(name, "stats.class.%zu.frees", i);
+		printf(", frees %zu\n", get_stat(name));
+	}
+
+	for (int i = 0; i < STATS_OBJECTS; i++) {
+		my_array_test_stats[i] = my_malloc(i % 2 ? 64 : 16384);
+	}
+	printf("%d objects of 64B and of 16KB, stats.allocated: %zu\n",
+		STATS_OBJECTS / 2, get_stat("stats.allocated"));
+	for (int i = 0; i < STATS_OBJECTS; i++) {
+		my_free(my_array_test_stats[i]);
+	}
+	my_mallctl("thread.flush", NULL, NULL, NULL, 0);
+	printf("freed, stats.allocated: %zu\n", get_stat("stats.allocated"));
+}
+
+/**
+ * This function turns on the sampling heap profiler, keeps 12.5MB of objects
+ * of 64B allocated in one function, allocates and frees 12.5MB of objects of
+ * 128KB in another, and writes a heap profile that pprof reads
+ * With MEMORYLIB_PROF_SIGNAL set it sends the signal to itself and waits
+ * for the dump while it doesn't allocate
+ * Then it times malloc/free pairs with the profiler off and on, the best of
+ * PROF_ROUNDS rounds of each, one after the other, so that the noise of
+ * single runs doesn't show as overhead
+ */
+#define PROF_RATE (512 * 1024)
+#define PROF_SMALL_OBJECTS 204800
+#define PROF_LARGE_OBJECTS 100
+#define PROF_PAIRS 1000000
+#define PROF_ROUNDS 5
+#define PROF_SIGNAL_WAIT_MS 1000
+void *my_array_test_prof[PROF_SMALL_OBJECTS];
+
+void prof_keep_small() {
+	for (int i = 0; i < PROF_SMALL_OBJECTS; i++) {
+		my_array_test_prof[i] = my_malloc(64);
+	}
+}
+
+void prof_churn_large() {
+	for (int i = 0; i < PROF_LARGE_OBJECTS; i++) {
+		my_array_test_prof[i] = my_malloc(128 * 1024);
+	}
+	for (int i = 0; i < PROF_LARGE_OBJECTS; i++) {
+		my_free(my_array_test_prof[i]);
+	}
+}
+
+double run_prof_pairs(size_t rate) {
+	struct timespec start, end;
+	unsigned int seed = 1;
+
+	my_mallctl("prof.rate", NULL, NULL, &rate, sizeof(rate));
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (int i = 0; i < PROF_PAIRS; i++) {
+		my_free(my_malloc(16 << (rand_r(&seed) % 5)));
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+void test_prof() {
+	size_t rate = PROF_RATE;
+	my_mallctl("prof.rate", NULL, NULL, &rate, sizeof(rate));
+
+	prof_churn_large();
+	prof_keep_small();
+	printf("prof.rate: %zu, prof.samples: %zu\n", get_stat("prof.rate"),
+		get_stat("prof.samples"));
+
+	const char *path = "memorylib.test.heap";
+	if (my_mallctl("prof.dump", NULL, NULL, &path, sizeof(path)) != 0) {
+		printf("prof.dump failed\n");
+	}
+	else {
+		printf("wrote %s, try pprof --text main %s\n", path, path);
+	}
+
+	for (int i = 0; i < PROF_SMALL_OBJECTS; i++) {
+		my_free(my_array_test_prof[i]);
+	}
+	printf("freed, prof.samples: %zu\n", get_stat("prof.samples"));
+
+	const char *dump_signal = getenv("MEMORYLIB_PROF_SIGNAL");
+	if (dump_signal != NULL) {
+		char dump_path[64];
+		sprintf(dump_path, "memorylib.%d.0.heap", getpid());
+		unlink(dump_path);
+		kill(getpid(), atoi(dump_signal));
+		int waited = 0;
+		while (access(dump_path, F_OK) != 0 && waited < PROF_SIGNAL_WAIT_MS) {
+			usleep(10000);
+			waited += 10;
+		}
+		printf("signal %s: %s %s\n", dump_signal, dump_path,
+			access(dump_path, F_OK) == 0 ? "written" : "NOT written");
+	}
+
+	double off = 0, on = 0;
+	for (int i = 0; i < PROF_ROUNDS; i++) {
+		double time = run_prof_pairs(0);
+		if (i == 0 || time < off)
+			off = time;
+		time = run_prof_pairs(PROF_RATE);
+		if (i == 0 || time < on)
+			on = time;
+	}
+	printf("%d malloc/free pairs, best of %d, profiler off: %.3fs, on: %.3fs\n",
+		PROF_PAIRS, PROF_ROUNDS, off, on);
+}
+
+/**
+ * This function turns on the scavenger with a decay time of 2s, allocates
+ * and frees 128MB of small objects in another thread and prints the RSS of
+ * the process while it is idle, until the memory goes back to the OS.
+ * Then a thread fills its local_cache in every size from 16 to 2048 bytes
+ * and stays alive without allocating, the RSS must go back to where it was
+ * before the thread.
+ * Last the main thread frees the objects of another thread and stays idle,
+ * the scavenger publishes the remote frees that it keeps, so after the other
+ * thread ends its pg_blocks are empty and go back to the OS
+ */
+#define DECAY_MS 2000
+#define DECAY_OBJECTS 1000000
+#define DECAY_PRINTS 12
+#define DECAY_IDLE_SIZES 8
+#define DECAY_IDLE_BYTES (4 << 20)			// Per size
+#define DECAY_IDLE_SLACK_KB 2048				// Stack of the thread and such
+// 32 pg_blocks of 127 objects, the first 96 objects of every pg_block are
+// published in full batches, the last 31 stay in the remote free slots
+#define DECAY_REMOTE_SIZE 2048
+#define DECAY_REMOTE_PG_BLOCKS 32
+#define DECAY_REMOTE_PER_PG_BLOCK 127
+#define DECAY_REMOTE_FIRST 96
+#define DECAY_REMOTE_OBJECTS (DECAY_REMOTE_PG_BLOCKS * DECAY_REMOTE_PER_PG_BLOCK)
+void *my_array_test_decay[DECAY_OBJECTS];
+volatile int decay_idle_ready = 0;
+volatile int decay_idle_done = 0;
+volatile int decay_remote_ready = 0;
+volatile int decay_remote_freed = 0;
+
+long rss_kb() {
+	long size, resident;
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (file == NULL || fscanf(file, "%ld %ld", &size, &resident) != 2) {
+		resident = 0;
+	}
+	if (file != NULL) {
+		fclose(file);
+	}
+	return resident * (getpagesize() / 1024);
+}
+
+void *th_test_decay(void *arg) {
+	for (int i = 0; i < DECAY_OBJECTS; i++) {
+		my_array_test_decay[i] = my_malloc(128);
+		memset(my_array_test_decay[i], 1, 128);
+	}
+	printf("allocated, rss: %ldKB\n", rss_kb());
+	for (int i = 0; i < DECAY_OBJECTS; i++) {
+		my_free(my_array_test_decay[i]);
+	}
+	return NULL;
+}
+
+void *th_test_decay_idle(void *arg) {
+	for (int i = 0; i < DECAY_IDLE_SIZES; i++) {
+		size_t size = 16 << i;
+		int objects = DECAY_IDLE_BYTES / size;
+		for (int j = 0; j < objects; j++) {
+			my_array_test_decay[j] = my_malloc(size);
+			memset(my_array_test_decay[j], 1, size);
+		}
+		for (int j = 0; j < objects; j++) {
+			my_free(my_array_test_decay[j]);
+		}
+	}
+	decay_idle_ready = 1;
+	// Idle, no allocator call until the test ends
+	while (!decay_idle_done) {
+		usleep(1000);
+	}
+	return NULL;
+}
+
+void *th_test_decay_remote(void *arg) {
+	for (int i = 0; i < DECAY_REMOTE_OBJECTS; i++) {
+		my_array_test_decay[i] = my_malloc(DECAY_REMOTE_SIZE);
+		memset(my_array_test_decay[i], 1, DECAY_REMOTE_SIZE);
+	}
+	decay_remote_ready = 1;
+	while (!decay_remote_freed) {
+		usleep(1000);
+	}
+	// The scavenger publishes the last remote frees meanwhile
+	usleep(2 * DECAY_MS * 1000);
+	return NULL;
+}
+
+void test_decay() {
+	size_t ms = DECAY_MS;
+	if (my_mallctl("decay.ms", NULL, NULL, &ms, sizeof(ms)) != 0) {
+		printf("decay.ms failed\n");
+		return;
+	}
+
+	pthread_t pthread;
+	if (pthread_create(&pthread, NULL, th_test_decay, NULL) != 0) {
+		perror("pthread_create\n");
+		return;
+	}
+	pthread_join(pthread, NULL);
+
+	for (int i = 0; i < DECAY_PRINTS; i++) {
+		printf("%4dms idle, rss: %6ldKB, stats.dirty: %9zu, stats.decay_purged: %9zu\n",
+			i * DECAY_MS / 4, rss_kb(), get_stat("stats.dirty"),
+			get_stat("stats.decay_purged"));
+		usleep(DECAY_MS / 4 * 1000);
+	}
+
+	long rss_base = rss_kb();
+	if (pthread_create(&pthread, NULL, th_test_decay_idle, NULL) != 0) {
+		perror("pthread_create\n");
+		return;
+	}
+	while (!decay_idle_ready) {
+		usleep(1000);
+	}
+	printf("idle thread, rss: %6ldKB\n", rss_kb());
+	usleep(2 * DECAY_MS * 1000);
+	long rss_after = rss_kb();
+	printf("idle thread after %dms, rss: %6ldKB, %s\n", 2 * DECAY_MS, rss_after,
+		rss_after <= rss_base + DECAY_IDLE_SLACK_KB ? "ok" : "FAILED");
+	decay_idle_done = 1;
+	pthread_join(pthread, NULL);
+
+	rss_base = rss_kb();
+	if (pthread_create(&pthread, NULL, th_test_decay_remote, NULL) != 0) {
+		perror("pthread_create\n");
+		return;
+	}
+	while (!decay_remote_ready) {
+		usleep(1000);
+	}
+	for (int i = 0; i < DECAY_REMOTE_OBJECTS; i++) {
+		if (i % DECAY_REMOTE_PER_PG_BLOCK < DECAY_REMOTE_FIRST) {
+			my_free(my_array_test_decay[i]);
+		}
+	}
+	for (int i = 0; i < DECAY_REMOTE_OBJECTS; i++) {
+		if (i % DECAY_REMOTE_PER_PG_BLOCK >= DECAY_REMOTE_FIRST) {
+			my_free(my_array_test_decay[i]);
+		}
+	}
+	decay_remote_freed = 1;
+	printf("remote frees, rss: %6ldKB\n", rss_kb());
+	pthread_join(pthread, NULL);
+	usleep(2 * DECAY_MS * 1000);
+	rss_after = rss_kb();
+	printf("remote frees after %dms, rss: %6ldKB, %s\n", 4 * DECAY_MS, rss_after,
+		rss_after <= rss_base + DECAY_IDLE_SLACK_KB ? "ok" : "FAILED");
+}
+
+/**
+ * This function runs generations of short lived threads, like a thread pool
+ * that recycles its threads. Every thread allocates objects of 64B and frees
+ * every other one before it ends, the objects it keeps are freed at the end
+ * The next threads adopt the half empty pg_blocks from the orphan pool, so
+ * the mapped memory grows only by the objects that are kept
+ * The pg_blocks left in the pool are emptied by remote frees, the scavenger
+ * takes them out of it, so their memory goes back to the OS
+ */
+#define ORPHAN_GENERATIONS 8
+#define ORPHAN_THREADS 4
+#define ORPHAN_OBJECTS 100000
+#define ORPHAN_POOL_RELEASED_KB 32768		// At least, of the pooled pg_blocks
+void *my_array_test_orphans[ORPHAN_GENERATIONS][ORPHAN_THREADS][ORPHAN_OBJECTS];
+
+void *th_test_orphans(void *arg) {
+	void **objects = (void**)arg;
+	for (int i = 0; i < ORPHAN_OBJECTS; i++) {
+		objects[i] = my_malloc(64);
+	}
+	for (int i = 0; i < ORPHAN_OBJECTS; i += 2) {
+		my_free(objects[i]);
+		objects[i] = NULL;
+	}
+	return NULL;
+}
+
+void test_orphans() {
+	pthread_t pthreads[ORPHAN_THREADS];
+
+	for (int generation = 0; generation < ORPHAN_GENERATIONS; generation++) {
+		for (int i = 0; i < ORPHAN_THREADS; i++) {
+			if (pthread_create(&pthreads[i], NULL, th_test_orphans,
+				my_array_test_orphans[generation][i]) != 0) {
+				perror("pthread_create\n");
+				return;
+			}
+		}
+		for (int i = 0; i < ORPHAN_THREADS; i++) {
+			pthread_join(pthreads[i], NULL);
+		}
+		printf("generation %d: stats.mapped: %9zu, stats.orphan_adoptions: %zu\n",
+			generation, get_stat("stats.mapped"),
+			get_stat("stats.orphan_adoptions"));
+	}
+
+	for (int generation = 0; generation < ORPHAN_GENERATIONS; generation++) {
+		for (int i = 0; i < ORPHAN_THREADS; i++) {
+			for (int j = 1; j < ORPHAN_OBJECTS; j += 2) {
+				my_free(my_array_test_orphans[generation][i][j]);
+			}
+		}
+	}
+	my_mallctl("thread.flush", NULL, NULL, NULL, 0);
+	long rss_freed = rss_kb();
+	printf("freed, stats.allocated: %zu, rss: %6ldKB\n",
+		get_stat("stats.allocated"), rss_freed);
+
+	size_t ms = DECAY_MS;
+	if (my_mallctl("decay.ms", NULL, NULL, &ms, sizeof(ms)) != 0) {
+		printf("decay.ms failed\n");
+		return;
+	}
+	usleep(3 * DECAY_MS * 1000);
+	long rss_after = rss_kb();
+	printf("pool after %dms, rss: %6ldKB, %s\n", 3 * DECAY_MS, rss_after,
+		rss_after <= rss_freed - ORPHAN_POOL_RELEASED_KB ? "ok" : "FAILED");
+}
+
 int main (int argc, char *argv[]) {
 
 	if (argc != 2) {
@@ -282,21 +1180,54 @@ int main (int argc, char *argv[]) {
 
 	int test = atoi(argv[1]);
 
-	if (ex == 1) {
+	if (test == 1) {
 		test_cache();
 	}
-	else if (ex == 2) {
+	else if (test == 2) {
 		test_cmp_swap_rem_free();
 	}
-	else if (ex == 3) {
+	else if (test == 3) {
 		test_realloc();
 	}
-	else if (ex == 4) {
+	else if (test == 4) {
 		test_termination();
 	}
-	else if (ex == 5) {
+	else if (test == 5) {
 		test_large_obj();
 	}
+	else if (test == 6) {
+		test_large_obj_churn();
+	}
+	else if (test == 7) {
+		test_fragmentation();
+	}
+	else if (test == 8) {
+		test_pipeline();
+	}
+	else if (test == 9) {
+		test_aligned();
+	}
+	else if (test == 10) {
+		test_calloc();
+	}
+	else if (test == 11) {
+		test_log_buffers();
+	}
+	else if (test == 12) {
+		test_free_sized();
+	}
+	else if (test == 13) {
+		test_stats();
+	}
+	else if (test == 14) {
+		test_prof();
+	}
+	else if (test == 15) {
+		test_decay();
+	}
+	else if (test == 16) {
+		test_orphans();
+	}
 
 	return 0;
 }
@@ -1,6 +1,14 @@
 #ifndef __LIST_H__
 #define __LIST_H__
 
+#include <stdio.h>
+
+//#define LISTLIB_DEBUG
+
+// Intrusive circular doubly linked list
+// Every node starts with the next pointer, the prev pointer and the list it
+// belongs to (NULL if it isn't in a list), so every operation is O(1)
+
 struct list {
 	int size;
 	void *head;
@@ -24,15 +32,230 @@ static inline void* list_get_next(void* node) {
 static inline void* list_get_prev(void* node) {
 	return *(void**)((char*)node + sizeof(void*));
 }
+static inline void list_set_list(void* node, struct list* list) {
+	node = (char*)node + 2 * sizeof(void*);
+	*(struct list**)node = list;
+	return;
+}
+static inline struct list* list_get_list(void* node) {
+	return *(struct list**)((char*)node + 2 * sizeof(void*));
+}
+
+// Creates a new list_t type list
+// Returns the pointer to the list if created succesfully
+// If there was an error, the function exits
+static inline void list_init(list_t *list) {
+	list->size = 0;
+	list->head = NULL;
+	list->tail = NULL;
+	return;
+}
 
-void list_init(list_t *list);
-int list_is_empty(list_t *list);
-void list_insert_front(list_t *list, void *node);
-void list_insert_back(list_t *list, void *node);
-void list_remove(list_t *list, void *node);
-void *list_remove_front(list_t *list);
-void *list_remove_back(list_t *list);
-void *list_get_front(list_t *list);
-void *list_get_back(list_t *list);
+// Returns 1 if list is empty, 0 if it's not empty
+static inline int list_is_empty(list_t *list) {
+	if (list->size == 0) {
+		return 1;
+	}
+	return 0;
+}
+
+// Inserts node in front of the list, as the head of the list
+static inline void list_insert_front(list_t *list, void *node) {
+	if (list->size == 0) {
+		list_set_next(node, node);
+		list_set_prev(node, node);
+		list->head = node;
+		list->tail = node;
+	}
+	else {
+		list_set_next(node, list->head);
+		list_set_prev(node, list->tail);
+		list_set_next(list->tail, node);
+		list_set_prev(list->head, node);
+		list->head = node;
+	}
+	list_set_list(node, list);
+	list->size++;
+
+	#ifdef LISTLIB_DEBUG
+	putchar('\n');
+	printf("File: %s, Line: %d: list_insert_front, node: %p\n",
+		__FILE__, __LINE__, node);
+	printf("File: %s, Line: %d: list_insert_front, head: %p\n",
+		__FILE__, __LINE__, list->head);
+	printf("File: %s, Line: %d: list_insert_front, tail: %p\n",
+		__FILE__, __LINE__, list->tail);
+	printf("File: %s, Line: %d: list_insert_front, node-next: %p\n",
+		__FILE__, __LINE__, list_get_next(node));
+	printf("File: %s, Line: %d: list_insert_front, node-prev: %p\n",
+		__FILE__, __LINE__, list_get_prev(node));
+	putchar('\n');
+	#endif
+	return;
+}
+
+// Inserts node at the end of the list, as the tail of the list
+static inline void list_insert_back(list_t *list, void *node) {
+	if (list->size == 0) {
+		list_set_next(node, node);
+		list_set_prev(node, node);
+		list->head = node;
+		list->tail = node;
+	}
+	else {
+		list_set_next(node, list->head);
+		list_set_prev(node, list->tail);
+		list_set_next(list->tail, node);
+		list_set_prev(list->head, node);
+		list->tail = node;
+	}
+	list_set_list(node, list);
+	list->size++;
+
+	#ifdef LISTLIB_DEBUG
+	putchar('\n');
+	printf("File: %s, Line: %d: list_insert_back, node: %p\n",
+		__FILE__, __LINE__, node);
+	printf("File: %s, Line: %d: list_insert_back, head: %p\n",
+		__FILE__, __LINE__, list->head);
+	printf("File: %s, Line: %d: list_insert_back, tail: %p\n",
+		__FILE__, __LINE__, list->tail);
+	printf("File: %s, Line: %d: list_insert_back, node-next: %p\n",
+		__FILE__, __LINE__, list_get_next(node));
+	printf("File: %s, Line: %d: list_insert_back, node-prev: %p\n",
+		__FILE__, __LINE__, list_get_prev(node));
+	putchar('\n');
+	#endif
+	return;
+}
+
+// Removes node from the list, if node is part of the list
+static inline void list_remove(list_t *list, void *node) {
+	if (list_get_list(node) != list) {
+		return;
+	}
+
+	if (list->size == 1) {
+		list->head = NULL;
+		list->tail = NULL;
+	}
+	else {
+		void *prev = list_get_prev(node);
+		void *next = list_get_next(node);
+		if (node == list->head) {
+			list->head = next;
+		}
+		if (node == list->tail) {
+			list->tail = prev;
+		}
+		list_set_next(prev, next);
+		list_set_prev(next, prev);
+		list_set_next(node, NULL);
+		list_set_prev(node, NULL);
+	}
+	list_set_list(node, NULL);
+	list->size--;
+
+	#ifdef LISTLIB_DEBUG
+	putchar('\n');
+	printf("File: %s, Line: %d: list_remove, node: %p\n",
+		__FILE__, __LINE__, node);
+	printf("File: %s, Line: %d: list_remove, head: %p\n",
+		__FILE__, __LINE__, list->head);
+	printf("File: %s, Line: %d: list_remove, tail: %p\n",
+		__FILE__, __LINE__, list->tail);
+	printf("File: %s, Line: %d: list_insert_back, node-next: %p\n",
+		__FILE__, __LINE__, list_get_next(node));
+	printf("File: %s, Line: %d: list_insert_back, node-prev: %p\n",
+		__FILE__, __LINE__, list_get_prev(node));
+	#endif
+	return;
+}
+
+// Removes the head of the list
+static inline void *list_remove_front(list_t *list) {
+	if (list->size == 0) {
+		return NULL;
+	}
+
+	void* node = list->head;
+	if (list->size == 1) {
+		list->head = NULL;
+		list->tail = NULL;
+	}
+	else {
+		list->head = list_get_next(node);
+		list_set_next(list->tail, list->head);
+		list_set_prev(list->head, list->tail);
+		list_set_next(node, NULL);
+		list_set_prev(node, NULL);
+	}
+	list_set_list(node, NULL);
+	list->size--;
+
+	#ifdef LISTLIB_DEBUG
+	putchar('\n');
+	printf("File: %s, Line: %d: list_remove_front, node: %p\n",
+		__FILE__, __LINE__, node);
+	printf("File: %s, Line: %d: list_remove_front, head: %p\n",
+		__FILE__, __LINE__, list->head);
+	printf("File: %s, Line: %d: list_remove_front, tail: %p\n",
+		__FILE__, __LINE__, list->tail);
+	printf("File: %s, Line: %d: list_insert_back, node-next: %p\n",
+		__FILE__, __LINE__, list_get_next(node));
+	printf("File: %s, Line: %d: list_insert_back, node-prev: %p\n",
+		__FILE__, __LINE__, list_get_prev(node));
+	putchar('\n');
+	#endif
+	return node;
+}
+
+// Removes the tail of the list
+static inline void *list_remove_back(list_t *list) {
+	if (list->size == 0) {
+		return NULL;
+	}
+
+	void* node = list->tail;
+	if (list->size == 1) {
+		list->head = NULL;
+		list->tail = NULL;
+	}
+	else {
+		list->tail = list_get_prev(node);
+		list_set_next(list->tail, list->head);
+		list_set_prev(list->head, list->tail);
+		list_set_next(node, NULL);
+		list_set_prev(node, NULL);
+	}
+	list_set_list(node, NULL);
+	list->size--;
+
+	#ifdef LISTLIB_DEBUG
+	putchar('\n');
+	printf("File: %s, Line: %d: list_remove_end, node: %p\n",
+		__FILE__, __LINE__, node);
+	printf("File: %s, Line: %d: list_remove_end, head: %p\n",
+		__FILE__, __LINE__, list->head);
+	printf("File: %s, Line: %d: list_remove_end, tail: %p\n",
+		__FILE__, __LINE__, list->tail);
+	printf("File: %s, Line: %d: list_insert_back, node-next: %p\n",
+		__FILE__, __LINE__, list_get_next(node));
+	printf("File: %s, Line: %d: list_insert_back, node-prev: %p\n",
+		__FILE__, __LINE__, list_get_prev(node));
+	putchar('\n');
+	#endif
+	return node;
+}
+
+// Returns the head
+static inline void *list_get_front(list_t *list) {
+	return (list->head);
+}
+
+// Returns the tail
+static inline void *list_get_back(list_t *list) {
+	return (list->tail);
+}
 
 #endif
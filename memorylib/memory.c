@@ -6,79 +6,621 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
+#include <errno.h>
 #include <pthread.h>
 #include <unistd.h>
 #include <sys/mman.h>
 #include <limits.h>
+#include <sched.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/syscall.h>
+#include <signal.h>
+#include <math.h>
+#include <execinfo.h>
+#include <dlfcn.h>
+#include <semaphore.h>
 #include "list.h"
 #include "atomic.h"
+#include "trace.h"
 
-#define handle_error(msg) char* error; asprintf(&error, "File: %s, Line: %d: %s", __FILE__, __LINE__, msg); perror(error); exit(EXIT_FAILURE);
+// Doesn't allocate memory, it can be used when malloc is memorylib
+#define handle_error(msg) { fprintf(stderr, "File: %s, Line: %d: %s: %s\n", __FILE__, __LINE__, msg, strerror(errno)); exit(EXIT_FAILURE); }
 
 #define MEMORYLIB_DEBUG
 
-#define CLASSES 10
+// Keeps a binary trace of the events of every thread, see trace.h
+//#define MEMORYLIB_TRACE
+
+// my_free_sized checks the size against the pg_map, objects that aren't
+// where their size says are freed with my_free
+//#define MEMORYLIB_CHECK_SIZED
+
+// Purges with MADV_FREE, the kernel takes the pages only when it needs
+// memory, otherwise with MADV_DONTNEED, which takes them at once
+//#define MEMORYLIB_PURGE_LAZY
+
+// The preload library replaces malloc, it can't print on the allocation path
+#ifdef MEMORYLIB_PRELOAD
+#undef MEMORYLIB_DEBUG
+#endif
+
+// Printing would change the timing that the trace shows
+#ifdef MEMORYLIB_TRACE
+#undef MEMORYLIB_DEBUG
+#define TRACE(type, ptr, memory_class, arg) \
+	trace_event(type, (void*)(ptr), memory_class, arg)
+#else
+#define TRACE(type, ptr, memory_class, arg)
+#endif
+
+// Up to 32B the classes grow by 8B, after that every power of two is split
+// into CLASSES_PER_DOUBLING classes
+#define CLASSES 29
+#define CLASSES_PER_DOUBLING 4
 // 0 : 1-4
 // 1 : 5-8
 // 2 : 9-16
-// 3 : 17-32
-// 4 : 33-64
-// 5 : 65-128
-// 6 : 129-256
-// 7 : 257-512
-// 8 : 513-1024
-// 9 : 1025-2048
+// 3 : 17-24
+// 4 : 25-32
+// 5 : 33-40, 6 : 41-48, 7 : 49-56, 8 : 57-64
+// 9 : 65-80, ..., 12 : 113-128
+// 13 : 129-160, ..., 16 : 225-256
+// 17 : 257-320, ..., 20 : 449-512
+// 21 : 513-640, ..., 24 : 897-1024
+// 25 : 1025-1280, ..., 28 : 1793-2048
 
 #define MAX_SIZE_SMALL_OBJ 2048
+// Bigger requests fail, their number of pages would overflow
+#define MAX_SIZE_LARGE_OBJ (1UL << 46)
 
+// The pg_block_header is located at the start of the pg_block
+// pg_blocks are alligned to their size, so the pg_block_header of an object
+// is found by masking its address
 #define PG_BLOCK_HEADER_SIZE 128
 #define OBJ_IN_PG_BLOCK_HINT 1024
 #define MIN_PG_BLOCK_SIZE 16384
 #define MAX_PG_BLOCK_SIZE 262144
-// Enough for 16GB concurrent memory allocation
-#define LARGE_OBJ_TABLE_SIZE 33554432
+
+// pg_blocks come from superblocks of 2MB, the size of a huge page
+#define SUPERBLOCK_SIZE (2 * 1024 * 1024)
+#define SUPERBLOCK_UNITS (SUPERBLOCK_SIZE / MIN_PG_BLOCK_SIZE)
+#define SUPERBLOCK_ORDERS 5			// pg_blocks are 1, 2, 4, 8 or 16 units
+// Superblocks get huge pages only when there are this many, the first touch
+// of a huge page makes all of it resident, small heaps would grow a lot
+#define SUPERBLOCK_HUGE_MIN 8
+#define SUPERBLOCK_CHUNK (64 * 1024)		// Descriptors are allocated in chunks
+// Free superblocks after the spare are purged and kept mapped, up to this many
+#define SUPERBLOCK_RETAINED_MAX 32
+
+// The pg_map maps every 4KB page of the 48-bit address space to the
+// memory that owns it. It is a two-level radix tree, the root is static and
+// the leaves (each one covers 1GB) are allocated on first use
+#define PG_MAP_SHIFT 12
+#define PG_MAP_BITS (48 - PG_MAP_SHIFT)
+#define PG_MAP_ROOT_BITS 18
+#define PG_MAP_LEAF_BITS (PG_MAP_BITS - PG_MAP_ROOT_BITS)
+#define PG_MAP_LEAF_SIZE (sizeof(unsigned long) << PG_MAP_LEAF_BITS)
+
+// A pg_map entry is a pointer tagged in its low bits
+// 0 means that the page doesn't belong to the library
+#define PG_MAP_SMALL 1			// pg_block_size of the pg_block
+#define PG_MAP_LARGE 2			// pointer to the large_span of an allocated object
+#define PG_MAP_FREE_SPAN 3	// pointer to a large_span in the shared large_cache
+#define PG_MAP_BOOTSTRAP 4	// memory of the bootstrap arena
+#define PG_MAP_TAG_MASK 7
+
+// Large objects are returned 16B after the start of their large_span,
+// the large_span header is saved at the start
+#define LARGE_OBJ_HEADER_SIZE 16
+// my_calloc maps new spans, which are zero, for objects of more pages
+#define LARGE_CALLOC_MAP_PAGES 16
+
+// Large objects are served from page-granular spans
+// Spans up to LARGE_SPAN_MAX_PAGES are cached and reused, bigger ones are
+// mapped and unmapped directly
+#define LARGE_SPAN_MAX_PAGES 256
+// The shared large_cache grows by at least this many pages at a time
+#define LARGE_SPAN_GROW_PAGES 256
+// Free pages kept by the shared large_cache, the rest go back to the OS
+#define LARGE_CACHE_MAX_PAGES 16384
+// Spans up to LARGE_LOCAL_SPAN_MAX_PAGES are also cached per thread,
+// up to LARGE_LOCAL_CACHE_MAX_PAGES in total
+#define LARGE_LOCAL_SPAN_MAX_PAGES 32
+#define LARGE_LOCAL_CACHE_MAX_PAGES 512
+
+// Every thread caches empty pg_blocks per cache_class up to
+// LOCAL_CACHE_HIGH bytes, past that the surplus goes to the global_cache
+// until LOCAL_CACHE_LOW bytes are left
+#define LOCAL_CACHE_HIGH 1048576
+#define LOCAL_CACHE_LOW 524288
+
+// The global_cache keeps up to GLOBAL_CACHE_DEPTH pg_blocks per cache_class
+// in every shard, threads use the shard of their cpu group first
+#define GLOBAL_CACHE_DEPTH 16
+#define GLOBAL_CACHE_SHARDS 8
+#define CPUS_PER_SHARD 4
+
+// The pg_blocks of every memory_class are kept in bins by their occupancy
+// Allocation uses the fullest bin that isn't full, so the emptier pg_blocks
+// get the chance to drain and go back to the caches
+#define HEAP_BINS 3
+#define HEAP_FULL 0					// No object to allocate locally
+#define HEAP_MOSTLY_FULL 1	// At least half of the objects are allocated
+#define HEAP_MOSTLY_EMPTY 2	// Less than half of the objects are allocated
+// Full pg_blocks checked for remote frees before getting a new pg_block
+#define HEAP_FULL_SCAN 4
+
+// pg_blocks of finished threads that have free objects go to the orphan pool
+// of their memory_class, in bins by their occupancy. Threads adopt them
+// before taking a pg_block from the caches, the fullest first like in the heap
+#define ORPHAN_BINS 4
+#define ORPHAN_BIN_DEPTH 1024
+
+// Remote frees are chained per destination pg_block in REMOTE_FREE_SLOTS
+// slots, a chain is published with one cmp&swap when it reaches
+// REMOTE_FREE_BATCH objects, and all chains every REMOTE_FREE_FLUSH remote
+// frees or when the thread ends. The scavenger publishes the chains of the
+// threads that stopped freeing
+#define REMOTE_FREE_SLOTS 64				// Must be 64, the hash keeps 6 bits
+#define REMOTE_FREE_BATCH 32
+#define REMOTE_FREE_FLUSH 1024
+
+// remotely_freed_LIFO keeps the number of objects in the LIFO in its upper
+// bits, user space addresses fit in the lower REMOTE_LIFO_COUNT_SHIFT bits
+#define REMOTE_LIFO_COUNT_SHIFT 48
+#define REMOTE_LIFO_PTR_MASK ((1UL << REMOTE_LIFO_COUNT_SHIFT) - 1)
+
+// Threads that can't use their heaps, while their thread_t is constructed or
+// after it is destroyed, allocate from the bootstrap arena in chunks of
+// BOOTSTRAP_CHUNK_SIZE, every object keeps its size in the
+// BOOTSTRAP_HEADER_SIZE bytes before it and is never freed
+// The chunks are taken from a range of BOOTSTRAP_RESERVE bytes while it
+// lasts, so my_free_sized knows them without the pg_map
+#define BOOTSTRAP_CHUNK_SIZE 262144
+#define BOOTSTRAP_HEADER_SIZE 16
+#define BOOTSTRAP_RESERVE (16 * 1024 * 1024)
+
+// States of the thread_t of a thread
+#define TH_NONE 0
+#define TH_CONSTRUCTING 1
+#define TH_READY 2
+#define TH_DESTROYED 3
 
 #define MAX_PRINT_LIFO 10
 
 // Global Variables
-int cache_classes;
 int pg_size;
 
 struct pg_block_header {
 	struct pg_block_header *next;				// Used by the lists
 	struct pg_block_header *prev;				// Used by the lists
-	volatile void *remotely_freed_LIFO;	// Head of LIFO that saves the remotel_freed_objects
+	list_t *list;												// Used by the lists, the list it is in
+	volatile void *remotely_freed_LIFO;	// Head of LIFO that saves the remotel_freed_objects, and their number
 	pthread_t id;												// Thread id
 	unsigned int object_size;						// The size of each oblject
+	unsigned int memory_class;					// The memory_class of the objects
 	void *unallocated_ptr;							// Points to the first unallocated object
+	void *untouched_ptr;								// From here on the pg_block was never used, set by pg_block_alloc
 	void *freed_LIFO;										// Head of LIFO that saves freed objects
 	unsigned int unallocated_objects;		// Number of unallocated object in the pg_block
 	unsigned int freed_objects;					// Number of free objects in the pg_block
+	unsigned int sampled_objects;				// Live objects sampled by the profiler
+	unsigned long idle_epoch;						// decay.epoch when it was cached
+	struct superblock *superblock;			// The superblock it was carved out of, set by pg_block_alloc
 };
 typedef struct pg_block_header pg_block_header_t;
-pg_block_header_t *global_cache[CLASSES];				// Global cache managed by the pg_manager
+static_assert(sizeof(pg_block_header_t) <= PG_BLOCK_HEADER_SIZE,
+	"The pg_block_header doesn't fit in PG_BLOCK_HEADER_SIZE");
 
 struct class_info{
 	unsigned int memory_size;
 	unsigned int pg_block_size;
-	unsigned int number_of_pages;
 	unsigned int obj_in_pg_block;
 	unsigned int wasted_obj_pg_header;
-	unsigned int wasted_obj_ptr_per_pg;
-	unsigned int wasted_obj_ptr_total;
+	unsigned int wasted_bytes;					// Bytes of the pg_block not used by objects
 	unsigned int cache_class;
+	unsigned int local_cache_high;			// Watermarks of the local_cache in pg_blocks
+	unsigned int local_cache_low;
+	unsigned int allignment;						// Every object is aligned to it
 };
 typedef struct class_info class_info_t;
-class_info_t class_info[CLASSES];		// Info for memory_classes
 
-struct large_obj_table {
-	void *array;
-	volatile void *freed_LIFO;
-	volatile void *unallocated_ptr;
+// Everything about the memory_classes is known at compile time
+// size_to_class[(size + 3) / 4] is the memory_class of size
+struct class_table {
+	class_info_t info[CLASSES];
+	unsigned char size_to_class[MAX_SIZE_SMALL_OBJ / 4 + 1];
+	int cache_classes;
+};
+typedef struct class_table class_table_t;
+
+static constexpr class_table_t make_class_table() {
+	class_table_t table = {};
+
+	/*---------- Initialize class_info ----------*/
+	unsigned int memory_size = 4;
+	for (int i = 0; i < CLASSES; i++) {
+		class_info_t &info = table.info[i];
+
+		/*---------- Initialize memory_size ----------*/
+		info.memory_size = memory_size;
+		if (memory_size < 16) {
+			memory_size = memory_size<<1;
+		}
+		else {
+			unsigned int power = 16;
+			while (power<<1 <= memory_size) {
+				power = power<<1;
+			}
+			memory_size += (power / CLASSES_PER_DOUBLING < 8) ? 8 :
+				power / CLASSES_PER_DOUBLING;
+		}
+
+		/*---------- Initialize pg_block_size and obj_in_pg_block ----------*/
+		// Initial estimation, rounded down to a power of two
+		unsigned int estimation = OBJ_IN_PG_BLOCK_HINT * info.memory_size;
+		info.pg_block_size = 1;
+		while (info.pg_block_size<<1 <= estimation) {
+			info.pg_block_size = info.pg_block_size<<1;
+		}
+
+		// Normalize pg_block_size between MIN_PG_BLOCK_SIZE and MAX_PG_BLOCK_SIZE
+		if (info.pg_block_size < MIN_PG_BLOCK_SIZE) {
+			info.pg_block_size = MIN_PG_BLOCK_SIZE;
+		}
+		else if (info.pg_block_size > MAX_PG_BLOCK_SIZE) {
+			info.pg_block_size = MAX_PG_BLOCK_SIZE;
+		}
+
+		// Measure the waste for the pg_block_header
+		info.wasted_obj_pg_header = (PG_BLOCK_HEADER_SIZE + info.memory_size - 1) /
+			info.memory_size;
+
+		// Measure how many objects in total are gonna be available in the pg_block
+		info.obj_in_pg_block = info.pg_block_size / info.memory_size -
+			info.wasted_obj_pg_header;
+		info.wasted_bytes = info.pg_block_size -
+			info.obj_in_pg_block * info.memory_size;
+
+		// Objects are placed every memory_size bytes from the start of the
+		// pg_block, which is aligned to its size, so they are aligned to the
+		// biggest power of two that divides memory_size
+		info.allignment = info.memory_size & -info.memory_size;
+
+		// Measure the watermarks of the local_cache, at least 2 and 1 pg_blocks
+		info.local_cache_high = LOCAL_CACHE_HIGH / info.pg_block_size;
+		if (info.local_cache_high < 2) {
+			info.local_cache_high = 2;
+		}
+		info.local_cache_low = LOCAL_CACHE_LOW / info.pg_block_size;
+		if (info.local_cache_low < 1) {
+			info.local_cache_low = 1;
+		}
+	}
+
+	// Assign memory_class to cache_class
+	table.cache_classes = 0;
+	unsigned int pg_block_size = 0;
+	for (int i = 0; i < CLASSES; i++) {
+		if (pg_block_size != table.info[i].pg_block_size) {
+			pg_block_size = table.info[i].pg_block_size;
+			table.cache_classes++;
+		}
+		table.info[i].cache_class = table.cache_classes-1;
+	}
+
+	// Every size maps to the smallest memory_class that fits it
+	int memory_class = 0;
+	for (unsigned int i = 0; i <= MAX_SIZE_SMALL_OBJ / 4; i++) {
+		if (i * 4 > table.info[memory_class].memory_size) {
+			memory_class++;
+		}
+		table.size_to_class[i] = memory_class;
+	}
+
+	return table;
+}
+
+constexpr class_table_t class_table = make_class_table();
+constexpr const class_info_t (&class_info)[CLASSES] = class_table.info;	// Info for memory_classes
+constexpr int cache_classes = class_table.cache_classes;
+
+static_assert(class_table.info[0].obj_in_pg_block <
+	(1UL << (64 - REMOTE_LIFO_COUNT_SHIFT)),
+	"The remotely_freed_LIFO can't count the objects of a pg_block");
+
+// A global_cache shard holds two lock-free stacks of slot indexes, one of the
+// slots that hold a cached pg_block and one of the free slots
+// The heads are tagged with a version in their upper 32 bits, so a head that
+// was popped and pushed again in between doesn't pass the compare and swap
+// The links live in the slots, so a pop never reads a pg_block that another
+// thread may have already returned to the OS
+struct global_cache_slot {
+	pg_block_header_t *pg_block_header;
+	volatile unsigned int next;					// Index + 1 of the next slot, 0 is the end
+};
+typedef struct global_cache_slot global_cache_slot_t;
+
+struct global_cache_shard {
+	volatile unsigned long long used;		// Tagged head of the cached pg_blocks
+	volatile unsigned long long free;		// Tagged head of the free slots
+	volatile unsigned int unused_slots;	// Slots never used so far start here
+	global_cache_slot_t slot[GLOBAL_CACHE_DEPTH];
+} __attribute__((aligned(64)));
+typedef struct global_cache_shard global_cache_shard_t;
+// Global cache managed by the pg_manager
+global_cache_shard_t global_cache[cache_classes][GLOBAL_CACHE_SHARDS];
+
+// The bins of the orphan pool are tagged stacks like the global_cache shards
+// A pooled pg_block belongs to the pool, remote frees go to its
+// remotely_freed_LIFO until a thread pops it
+struct orphan_bin {
+	volatile unsigned long long used;		// Tagged head of the pooled pg_blocks
+	volatile unsigned long long free;		// Tagged head of the free slots
+	volatile unsigned int unused_slots;	// Slots never used so far start here
+	global_cache_slot_t slot[ORPHAN_BIN_DEPTH];
+} __attribute__((aligned(64)));
+typedef struct orphan_bin orphan_bin_t;
+orphan_bin_t orphan_pool[CLASSES][ORPHAN_BINS];
+
+// pg_blocks are carved out of superblocks of SUPERBLOCK_SIZE, aligned to it
+// and backed by transparent huge pages, in units of MIN_PG_BLOCK_SIZE
+// Every pg_block is aligned to its size in the superblock
+// The descriptors live outside the superblocks, so that no unit is lost
+struct superblock {
+	struct superblock *next;						// Used by the lists
+	struct superblock *prev;						// Used by the lists
+	list_t *list;												// Used by the lists, partial, retained or none
+	struct superblock *next_free;				// Next of the free descriptors
+	char *base;
+	unsigned int shard;									// The superblock_shard it carves pg_blocks for
+	unsigned int free_units;
+	unsigned long used[SUPERBLOCK_UNITS / 64];		// Units in pg_blocks
+	unsigned long dirty[SUPERBLOCK_UNITS / 64];		// Free units that may not be zero
+	unsigned long purged[SUPERBLOCK_UNITS / 64];	// Free dirty units purged
+};
+typedef struct superblock superblock_t;
+
+// The superblocks that pg_blocks are carved out of are split in shards like
+// the global_cache, a superblock stays in the shard of the thread that took
+// it until all of it is free again
+// partial[order] holds the superblocks whose largest aligned run of free
+// units is 2^order units, so a pg_block is carved out of the front of the
+// first list from its order that isn't empty
+struct superblock_shard {
+	pthread_mutex_t lock;
+	list_t partial[SUPERBLOCK_ORDERS];
+} __attribute__((aligned(64)));
+typedef struct superblock_shard superblock_shard_t;
+static_assert(GLOBAL_CACHE_SHARDS == 8, "One initializer per superblock_shard");
+superblock_shard_t superblock_shards[GLOBAL_CACHE_SHARDS] = {
+	{ PTHREAD_MUTEX_INITIALIZER }, { PTHREAD_MUTEX_INITIALIZER },
+	{ PTHREAD_MUTEX_INITIALIZER }, { PTHREAD_MUTEX_INITIALIZER },
+	{ PTHREAD_MUTEX_INITIALIZER }, { PTHREAD_MUTEX_INITIALIZER },
+	{ PTHREAD_MUTEX_INITIALIZER }, { PTHREAD_MUTEX_INITIALIZER } };
+
+// The superblocks that are free, whole, and the descriptors
+// The shards take a superblock from here only when they have no run of
+// free units left, and give it back when all of it is free
+struct superblock_manager {
+	pthread_mutex_t lock;
+	superblock_t *spare;								// A free superblock kept mapped
+	list_t retained;										// Free superblocks, purged
+	char *hint;													// Where the next superblock is mapped
+	superblock_t *free_descriptors;
+	char *chunk;												// The rest of the last chunk
+	size_t chunk_left;
+	volatile size_t superblocks;				// Mapped, with the spare and retained
+	volatile unsigned long long dirty_units;		// Free units that may hold pages
+	volatile unsigned long long new_dirty_units;	// Of them, freed since the last decay tick
+};
+typedef struct superblock_manager superblock_manager_t;
+superblock_manager_t superblock_manager = { PTHREAD_MUTEX_INITIALIZER };
+
+volatile unsigned long *pg_map[1 << PG_MAP_ROOT_BITS];
+volatile unsigned int large_objects;	// Number of allocated large objects
+
+struct large_span {
+	size_t number_of_pages;				// Size of the span in pages
+	size_t sampled;								// The profiler sampled the object, keeps the objects 16B alligned
+	struct large_span *next;			// Used by the lists, only when the span is free
+	struct large_span *prev;			// Used by the lists, only when the span is free
+	list_t *list;									// Used by the lists, only when the span is free
+};
+typedef struct large_span large_span_t;
+
+// Shared tier of the large object cache
+// Free spans are kept in bins by their number of pages and are coalesced with
+// their free neighbours
+struct large_cache {
+	pthread_mutex_t lock;
+	list_t bin[LARGE_SPAN_MAX_PAGES];	// bin[i] holds spans of i+1 pages
+	list_t huge_bin;									// Spans of more than LARGE_SPAN_MAX_PAGES
+	size_t free_pages;
+};
+typedef struct large_cache large_cache_t;
+large_cache_t large_cache = { PTHREAD_MUTEX_INITIALIZER };
+
+// Chain of objects freed by a thread that doesn't own their pg_block
+struct remote_free {
+	pg_block_header_t *pg_block_header;	// Destination of the chain, NULL if unused
+	void *head;
+	void *tail;
+	unsigned int objects;
+};
+typedef struct remote_free remote_free_t;
+
+// Counters of a thread, they are merged with the counters of the other
+// threads when they are read
+// Every field is a size_t, so two stats can be added as arrays
+struct class_stats {
+	size_t allocs;
+	size_t frees;
+};
+typedef struct class_stats class_stats_t;
+
+struct stats {
+	class_stats_t classes[CLASSES];
+	size_t remote_frees;				// Frees of objects of other threads' pg_blocks
+	size_t orphan_adoptions;
+	size_t local_cache_hits;		// pg_blocks from the local_cache
+	size_t local_cache_misses;
+	size_t global_cache_hits;		// pg_blocks from the global_cache
+	size_t global_cache_misses;	// pg_blocks from the OS
+	size_t large_allocs;
+	size_t large_frees;
+	size_t large_pages;					// Pages of the allocated large objects
+	size_t cas_retries;					// Failed cmp&swaps
+};
+typedef struct stats stats_t;
+
+// Node of the list of the stats of the running threads
+struct stats_node {
+	struct stats_node *next;		// Used by the lists
+	struct stats_node *prev;		// Used by the lists
+	list_t *list;								// Used by the lists
+	stats_t *stats;
+	struct thread *thread;			// The scavenger drains its local_cache
+};
+typedef struct stats_node stats_node_t;
+
+struct stats_registry {
+	pthread_mutex_t lock;
+	list_t threads;							// stats_node of every running thread
+	stats_t retired;						// Sum of the stats of the finished threads
+};
+typedef struct stats_registry stats_registry_t;
+stats_registry_t stats_registry = { PTHREAD_MUTEX_INITIALIZER };
+
+// Counters of the calls to the OS, they are shared by all threads
+struct os_stats {
+	volatile unsigned long long mmaps;
+	volatile unsigned long long munmaps;
+	volatile unsigned long long mremaps;
+	volatile unsigned long long purges;		// madvise calls that free pages
+	volatile unsigned long long mapped;		// Bytes mapped from the OS
+};
+typedef struct os_stats os_stats_t;
+os_stats_t os_stats;
+
+/* Sampling heap profiler
+ * With MEMORYLIB_PROF_RATE=<bytes> every thread samples an allocation every
+ * <bytes> allocated on average, the intervals are random with a geometric
+ * distribution like in tcmalloc, so that big objects are sampled more often
+ * my_mallctl("prof.rate") changes it, other threads see it at their next
+ * sample, or after PROF_OFF_INTERVAL bytes if it was off
+ * A sample keeps the stack of the allocation until the object is freed
+ * Profiles are written in the heap format of pprof with
+ * my_mallctl("prof.dump"), or by a thread of the profiler when the signal
+ * MEMORYLIB_PROF_SIGNAL=<signal number> comes, to memorylib.<pid>.<n>.heap
+ * in MEMORYLIB_PROF_DIR or in the current directory
+ */
+#define PROF_DEPTH 32								// Frames of a stack
+#define PROF_SKIP 8									// Frames of memorylib skipped at most
+#define PROF_HASH 4096							// Buckets of the hash tables
+#define PROF_CHUNK (64 * 1024)			// Memory is taken from the OS in chunks
+#define PROF_OFF_INTERVAL (1L << 30)	// Threads check if it was turned on
+
+// The samples with the same stack
+struct prof_bucket {
+	struct prof_bucket *next;					// Next of the hash chain
+	unsigned long hash;
+	int depth;
+	void *stack[PROF_DEPTH];
+	size_t alloc_objects;							// Sampled, ever
+	size_t alloc_bytes;
+	size_t live_objects;							// Sampled, not freed yet
+	size_t live_bytes;
+};
+typedef struct prof_bucket prof_bucket_t;
+
+// A sampled object that is live
+struct prof_sample {
+	struct prof_sample *next;					// Next of the hash chain, or free
+	void *ptr;
+	size_t size;
+	prof_bucket_t *bucket;
+};
+typedef struct prof_sample prof_sample_t;
+
+struct prof {
+	pthread_once_t once;
+	size_t rate;												// Average bytes between samples, 0 is off
+	pthread_mutex_t lock;								// Protects everything below
+	prof_bucket_t **buckets;						// By stack hash
+	prof_sample_t **samples;						// By ptr
+	prof_sample_t *free_samples;
+	char *chunk;												// The rest of the last chunk
+	size_t chunk_left;
+	size_t live_samples;
+	unsigned long dumps;
+	sem_t dump_semaphore;								// Posted by the signal
+};
+typedef struct prof prof_t;
+prof_t prof = { PTHREAD_ONCE_INIT, 0, PTHREAD_MUTEX_INITIALIZER };
+
+// Counts size bytes allocated by the calling thread, samples ptr at the end
+// of an interval
+#define PROF_MALLOC(ptr, size) \
+	do { \
+		if ((th->prof_countdown -= (long)(size)) < 0) { \
+			prof_sample(ptr, size); \
+		} \
+	} while (0)
+
+/* Decay of the cached memory
+ * With MEMORYLIB_DECAY_MS=<ms> a background thread, the scavenger, gives the
+ * memory that stays unused back to the OS in about <ms> milliseconds. It
+ * runs DECAY_STEPS ticks per decay time, no work is done on the hot paths:
+ * - pg_blocks idle in the global_cache for the decay time go back to their
+ *   superblock
+ * - free units of the superblocks that hold pages are purged, of the units
+ *   freed k ticks ago at most (DECAY_STEPS - k) / DECAY_STEPS are left, like
+ *   the dirty decay of jemalloc with a linear curve
+ * - pg_blocks idle in a local_cache for the decay time go back to their
+ *   superblock and the chains of remote frees of every thread are published,
+ *   the thread and the scavenger take them with busy and neither waits for
+ *   the other, so threads that don't allocate anymore are drained too
+ *   While the decay is off the threads keep busy private and take no lock,
+ *   a thread left idle since then is drained after its next pg_block refill,
+ *   return or remote free
+ * - pg_blocks of the orphan pool are taken and given up again, the ones
+ *   that remote frees emptied go back to the global_cache, the rest are
+ *   pooled again in the bin of their occupancy
+ * What stays resident: the pg_blocks that hold objects, orphaned ones too,
+ * the large_local_cache of every thread, up to LARGE_LOCAL_CACHE_MAX_PAGES,
+ * the large_cache, the retained superblocks and the backlog of the decay
+ * curve, and the bootstrap arena
+ * my_mallctl("decay.ms") changes the time, 0 turns it off
+ */
+#define DECAY_STEPS 16
+#define DECAY_OFF_SLEEP_MS 1000			// The scavenger checks if it was turned on
+// States of thread.busy
+#define BUSY_FREE 0									// The scavenger may take it
+#define BUSY_HELD 1									// Taken by the thread or by the scavenger
+#define BUSY_PRIVATE 2							// The decay is off, only the thread uses it
+
+struct decay {
+	pthread_once_t once;
+	volatile size_t ms;
+	volatile unsigned long epoch;				// Ticks of the scavenger
+	size_t backlog[DECAY_STEPS];				// Units freed in the last ticks, newest first
+	volatile size_t purged_units;
 };
-typedef struct large_obj_table large_obj_table_t;
-large_obj_table_t large_obj_table;
+typedef struct decay decay_t;
+decay_t decay = { PTHREAD_ONCE_INIT };
+
+extern "C" void decay_start();
+
+extern "C" void prof_init();
+extern "C" void prof_signal(int signal);
+extern "C" void prof_dump_start();
+extern "C" long prof_interval(unsigned long *random);
+extern "C" void prof_sample(void *ptr, size_t size);
+extern "C" int prof_dump(const char *path);
 
 extern "C" void print_pseudo_LIFO(volatile void *lifo);
 extern "C" void print_LIFO(volatile void *lifo);
@@ -88,15 +630,64 @@ extern "C" void print_heap();
 extern "C" void print_less_heap();
 
 extern "C" void pg_block_free(pg_block_header_t* pg_block_header);
+extern "C" void large_cache_flush(list_t *local_bin, size_t *local_pages);
 extern "C" int get_memory_class(size_t size);
 extern "C" void *atomic_empty_lifo(volatile void** address);
 extern "C" int pseudo_lifo_size(void *lifo);
 extern "C" int lifo_size(void *lifo);
+extern "C" void remote_free_flush_all();
+extern "C" int remote_free_publish(remote_free_t *remote_free);
+extern "C" void *remote_lifo_ptr(volatile void *lifo);
+extern "C" unsigned int remote_lifo_count(volatile void *lifo);
+extern "C" void *remote_lifo_pack(void *ptr, unsigned int count);
+extern "C" int ptr_to_pseudo_ptr(void *ptr);
+extern "C" void pg_block_collect_remote(pg_block_header_t *pg_block_header);
+extern "C" void return_pg_block(pg_block_header_t* pg_block_header);
+extern "C" int orphan_pool_push(pg_block_header_t *pg_block_header);
+extern "C" void pg_block_orphan(pg_block_header_t *pg_block_header);
+extern "C" void stats_add(stats_t *to, stats_t *from);
+extern "C" void *memory_alloc(size_t size);
+extern "C" void memory_dealloc(void* mem, size_t size);
+
+#ifdef MEMORYLIB_TRACE
+extern "C" void trace_event(unsigned int type, void *ptr,
+	unsigned int memory_class, unsigned long arg);
+extern "C" int trace_dump();
+
+// Ring of the last TRACE_EVENTS events of a thread
+struct trace_ring {
+	unsigned long events;								// Events ever written
+	trace_event_t event[TRACE_EVENTS];
+};
+typedef struct trace_ring trace_ring_t;
+// Clock readings when the library was loaded
+unsigned long long trace_start_tsc;
+unsigned long long trace_start_ns;
+#endif
+
+struct thread;
+thread_local struct thread *th = NULL;
+extern "C" int thread_busy_take(struct thread *thread);
+extern "C" void thread_busy_give(struct thread *thread);
+thread_local int th_state = TH_NONE;
 
 struct thread {
 	pthread_t id;
-	list_t heap[CLASSES];
-	pg_block_header_t *local_cache[CLASSES];
+	list_t heap[CLASSES][HEAP_BINS];
+	list_t local_cache[CLASSES];
+	volatile unsigned int busy;					// The local_cache and remote_free are used
+																			// by the thread or by the scavenger
+	list_t large_local_cache[LARGE_LOCAL_SPAN_MAX_PAGES];
+	size_t large_local_cache_pages;
+	remote_free_t remote_free[REMOTE_FREE_SLOTS];
+	unsigned int remote_free_ops;				// Remote frees since the last flush
+	stats_t stats;
+	stats_node_t stats_node;
+	#ifdef MEMORYLIB_TRACE
+	trace_ring_t *trace;
+	#endif
+	long prof_countdown;								// Bytes to allocate until the next sample
+	unsigned long prof_random;					// State of the random intervals
 
 	thread() {
 		id = pthread_self();
@@ -104,9 +695,41 @@ struct thread {
 		printf("thread: Implicitly caught thread start, th: %ld\n", id);
 		#endif
 		for (int i=0; i<CLASSES; i++) {
-			list_init(&heap[i]);
-			local_cache[i] = NULL;
+			for (int j = 0; j < HEAP_BINS; j++) {
+				list_init(&heap[i][j]);
+			}
+			list_init(&local_cache[i]);
+		}
+		busy = decay.ms == 0 ? BUSY_PRIVATE : BUSY_FREE;
+		for (int i = 0; i < LARGE_LOCAL_SPAN_MAX_PAGES; i++) {
+			list_init(&large_local_cache[i]);
+		}
+		large_local_cache_pages = 0;
+		for (int i = 0; i < REMOTE_FREE_SLOTS; i++) {
+			remote_free[i].pg_block_header = NULL;
+		}
+		remote_free_ops = 0;
+
+		memset(&stats, 0, sizeof(stats));
+		stats_node.stats = &stats;
+		stats_node.thread = this;
+		pthread_mutex_lock(&stats_registry.lock);
+		list_insert_front(&stats_registry.threads, &stats_node);
+		pthread_mutex_unlock(&stats_registry.lock);
+
+		// The profiler is configured by the first thread, it may come before
+		// the initializer
+		pthread_once(&prof.once, prof_init);
+		prof_random = ((unsigned long)this ^ (unsigned long)time(NULL)) | 1;
+		prof_countdown = prof_interval(&prof_random);
+
+		#ifdef MEMORYLIB_TRACE
+		// The ring is touched as it fills, NULL disables tracing
+		trace = (trace_ring_t*)memory_alloc(sizeof(trace_ring_t));
+		if (trace != NULL) {
+			trace->events = 0;
 		}
+		#endif
 	}
 
 	~thread() {
@@ -114,291 +737,979 @@ struct thread {
 		printf("~thread: Implicitly caught thread end, th: %ld\n", id);
 		#endif
 
+		// The local_cache and remote_free are kept busy, so the scavenger
+		// leaves them alone until the thread is out of the registry
+		while (!thread_busy_take(this)) {
+			sched_yield();
+		}
+
+		// Publish the buffered remote frees, it may adopt orphaned pg_blocks
+		remote_free_flush_all();
+
+		// Give the cached large spans to the shared large_cache
+		large_cache_flush(large_local_cache, &large_local_cache_pages);
+
 		// Free local_cache
 		for (int i = 0; i < cache_classes; i++) {
-			if (local_cache[i] != NULL){
-				pg_block_free(local_cache[i]);
+			while (!list_is_empty(&local_cache[i])) {
+				pg_block_free((pg_block_header_t*)list_remove_front(&local_cache[i]));
 			}
 		}
 
 		// Free pg_blocks
 		for (int memory_class = 0; memory_class < CLASSES; memory_class++) {
-			while (1) {
-				pg_block_header_t * pg_block_header = (pg_block_header_t*)
-					list_remove_front(&heap[memory_class]);
-				if (pg_block_header == NULL)
-					break;
-				do {
-					// Move remotely_freed_LIFO to freed_LIFO
-					if (pg_block_header->remotely_freed_LIFO != NULL) {
-						pg_block_header->freed_LIFO = atomic_empty_lifo(
-							&pg_block_header->remotely_freed_LIFO);
-						// Count the lifo_size
-						if (memory_class == 0)
-							pg_block_header->freed_objects += pseudo_lifo_size(
-								pg_block_header->freed_LIFO);
-						else
-							pg_block_header->freed_objects += lifo_size(
-								pg_block_header->freed_LIFO);
-					}
-
-					// if all of pg_block's obj are freed, free the pg_block
-					if (pg_block_header->unallocated_objects + pg_block_header->
-						freed_objects == class_info[memory_class].obj_in_pg_block) {
-							pg_block_free(pg_block_header);
-							break;
-					}
-
-					if (pg_block_header->id == id) {
-						// Make pg_block orphaned
-						pg_block_header->id = 0;
-					}
-					// if remotely_freed_LIFO isn't NULL repeat the processe
-					// If it is NULL change it to 0x1 - orphaned
-					if (compare_and_swap_ptr(&pg_block_header->remotely_freed_LIFO,
-						NULL, (void*)1) == 0) {
-						continue;
-					}
-					else
+			for (int bin = 0; bin < HEAP_BINS; bin++) {
+				while (1) {
+					pg_block_header_t * pg_block_header = (pg_block_header_t*)
+						list_remove_front(&heap[memory_class][bin]);
+					if (pg_block_header == NULL)
 						break;
-				} while (1);
+					// Make pg_block orphaned
+					pg_block_header->id = 0;
+					pg_block_orphan(pg_block_header);
+				}
 			}
 		}
 
+		#ifdef MEMORYLIB_TRACE
+		if (trace != NULL) {
+			trace_dump();
+			trace_ring_t *ring = trace;
+			trace = NULL;
+			memory_dealloc(ring, sizeof(trace_ring_t));
+		}
+		#endif
+
+		// Keep the counters of the thread
+		pthread_mutex_lock(&stats_registry.lock);
+		list_remove(&stats_registry.threads, &stats_node);
+		stats_add(&stats_registry.retired, &stats);
+		pthread_mutex_unlock(&stats_registry.lock);
+
+		th = NULL;
+		th_state = TH_DESTROYED;
 	}
 };
 typedef struct thread thread_t;
-thread_local thread_t *th = NULL;
 
-extern "C" void *memory_alloc(size_t size) {
-	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
-		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
-	if (mem == MAP_FAILED) { handle_error("mmap failed"); }
-	return mem;
+// Takes the local_cache and remote_free of the thread, returns 0 if the
+// scavenger has them
+// While the decay is off busy is private and no atomic is needed, the
+// scavenger only takes it from BUSY_FREE
+extern "C" int thread_busy_take(thread_t *thread) {
+	if (thread->busy == BUSY_PRIVATE && decay.ms == 0) {
+		return 1;
+	}
+	return compare_and_swap32(&thread->busy, BUSY_FREE, BUSY_HELD) ||
+		compare_and_swap32(&thread->busy, BUSY_PRIVATE, BUSY_HELD);
 }
 
-extern "C" void memory_dealloc(void* mem, size_t size) {
-	if (munmap(mem, size) == -1) { handle_error("munmap failed"); }
+// Gives back what thread_busy_take took, it stays private if the decay is off
+extern "C" void thread_busy_give(thread_t *thread) {
+	if (thread->busy == BUSY_HELD) {
+		fetch_and_store(&thread->busy, decay.ms == 0 ? BUSY_PRIVATE : BUSY_FREE);
+	}
 }
 
-// If u want to print ptr in binary pass the size and the pointer to ptr
-extern "C" void printBits(size_t const size, void const *ptr) {
-	unsigned char *b = (unsigned char*) ptr;
-	unsigned char byte;
-	int i, j;
-	for (i = size-1; i >= 0; i--) {
-		for (j = 7; j >= 0; j--) {
-			byte = (b[i] >> j) & 1;
-			printf("%u", byte);
-		}
-		putchar(' ');
+// Makes sure that the thread_t of the calling thread exists
+// Returns 0 if the heaps of the thread can't be used, while its thread_t is
+// constructed (constructing it can allocate memory) or after it is destroyed
+extern "C" int thread_attach() {
+	if (th_state != TH_NONE) {
+		return th_state == TH_READY;
+	}
+	th_state = TH_CONSTRUCTING;
+	if (pg_size == 0) {
+		// Memory can be allocated before the initializer runs
+		pg_size = getpagesize();
 	}
-	puts("");
-}
 
-extern "C" void print_memory_class(unsigned int memory_class) {
-	printf("---------- Memory Class %u ----------\n", memory_class);
-	printf("memory_size: %u\n", class_info[memory_class].memory_size);
-	printf("pg_block_size: %u\n", class_info[memory_class].pg_block_size);
-	printf("number_of_pages: %u\n", class_info[memory_class].number_of_pages);
-	printf("obj_in_pg_block: %u\n", class_info[memory_class].obj_in_pg_block);
-	printf("wasted_obj_pg_header: %u\n", class_info[memory_class].wasted_obj_pg_header);
-	printf("wasted_obj_ptr_per_pg: %u\n", class_info[memory_class].wasted_obj_ptr_per_pg);
-	printf("wasted_obj_ptr_total: %u\n", class_info[memory_class].wasted_obj_ptr_total);
-	printf("cache_class: %u\n", class_info[memory_class].cache_class);
-	printf("------------------------------------\n");
+	// We define a thread_local variable, that will be per-thread.
+	// We also make it static, in order to persist for the lifetime of the thread.
+	// When the variable comes to life, the constructor is executed (thread).
+	// When the variable comes out of scope, at the end of the life of the thread,
+	// given that it is static, the destructor is executed (~thread).
+	thread_local static thread_t my_th;
+	th = &my_th;
+	th_state = TH_READY;
+	return 1;
 }
 
-// Returns 4 Byte-pseudo ptr
-extern "C" int ptr_to_pseudo_ptr(void *ptr) {
-	return ((long int)ptr & UINT_MAX);
+// Adds the counters of from to to
+extern "C" void stats_add(stats_t *to, stats_t *from) {
+	for (size_t i = 0; i < sizeof(stats_t) / sizeof(size_t); i++) {
+		((size_t*)to)[i] += ((size_t*)from)[i];
+	}
 }
 
-// Returns 4 Byte-pseudo ptr
-extern "C" void *pseudo_ptr_to_ptr(int *pseudo_ptr) {
-	if (*pseudo_ptr == 0)
-		return NULL;
-	return (void*) (
-		((long unsigned int)pseudo_ptr & ((long unsigned int)~0 - UINT_MAX)) +
-		*(unsigned int*)pseudo_ptr
-	);
+// Counts a failed cmp&swap of the calling thread on address
+extern "C" void stats_cas_retry(volatile void *address) {
+	if (th != NULL) {
+		th->stats.cas_retries++;
+		TRACE(TRACE_CAS_RETRY, address, TRACE_NO_CLASS, 0);
+	}
 }
 
-extern "C" void print_pseudo_LIFO(volatile void *lifo) {
-	int i = 0;
-	while (lifo != NULL && lifo != (void*)1) {
-		if (i < MAX_PRINT_LIFO)
-			printf("%p->", lifo);
-		else if (i == MAX_PRINT_LIFO + 1)
-			printf(".....->");
-		lifo = pseudo_ptr_to_ptr((int*)lifo);
-		i++;
-	}
-	printf("%p\n", lifo);
+#ifdef MEMORYLIB_TRACE
+extern "C" unsigned long long trace_ns() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ULL + now.tv_nsec;
 }
 
-extern "C" void print_LIFO(volatile void *lifo) {
-	int i = 0;
-	while (lifo != NULL && lifo != (void*)1) {
-		if (i < MAX_PRINT_LIFO)
-			printf("%p->", lifo);
-		else if (i == MAX_PRINT_LIFO + 1)
-			printf(".....->");
-		lifo = *(void**)lifo;
-		i++;
+// Writes an event to the ring of the calling thread, the oldest event is
+// overwritten when the ring is full
+extern "C" void trace_event(unsigned int type, void *ptr,
+	unsigned int memory_class, unsigned long arg) {
+	if (th == NULL || th->trace == NULL) {
+		return;
 	}
-	printf("%p\n", lifo);
+	trace_event_t *event = &th->trace->event[th->trace->events &
+		(TRACE_EVENTS - 1)];
+	event->tsc = trace_tsc();
+	event->ptr = (unsigned long)ptr;
+	event->info = trace_info(type, memory_class, arg);
+	th->trace->events++;
 }
 
-extern "C" void print_large_obj_table() {
-	printf("--------------- large_obj_table ---------------\n");
-	printf("array: %p|  unallocated: %p|\n",
-		large_obj_table.array, large_obj_table.unallocated_ptr);
-
-	printf("freed_LIFO: ");
-	print_LIFO(large_obj_table.freed_LIFO);
+// Writes the ring of the calling thread to memorylib.<pid>.<tid>.trace
+// Returns 0 or the errno of the failure
+extern "C" int trace_dump() {
+	if (th == NULL || th->trace == NULL) {
+		return 0;
+	}
+	trace_ring_t *ring = th->trace;
+
+	char path[4096];
+	const char *dir = getenv("MEMORYLIB_TRACE_DIR");
+	long tid = syscall(SYS_gettid);
+	snprintf(path, sizeof(path), "%s/memorylib.%d.%ld.trace",
+		dir != NULL ? dir : ".", getpid(), tid);
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		return errno;
+	}
 
-	printf("table: ");
-	int i = 0;
-	for (void *tmp = large_obj_table.array; tmp < large_obj_table.unallocated_ptr;
-		tmp = (void*)((long)tmp + 8)) {
-			if (i < MAX_PRINT_LIFO)
-				printf("%p->", *(void**)tmp);
-			else if (i == MAX_PRINT_LIFO + 1)
-				printf(".....");
-			i++;
+	trace_header_t header;
+	header.magic = TRACE_MAGIC;
+	header.tid = tid;
+	header.events = ring->events < TRACE_EVENTS ? ring->events : TRACE_EVENTS;
+	header.start_tsc = trace_start_tsc;
+	header.start_ns = trace_start_ns;
+	header.dump_tsc = trace_tsc();
+	header.dump_ns = trace_ns();
+
+	// From the oldest event to the newest, in two parts if the ring wrapped
+	unsigned long first = ring->events - header.events;
+	int ok = write(fd, &header, sizeof(header)) == sizeof(header);
+	for (unsigned long done = 0; ok && done < header.events; ) {
+		unsigned long index = (first + done) & (TRACE_EVENTS - 1);
+		unsigned long count = header.events - done;
+		if (count > TRACE_EVENTS - index) {
+			count = TRACE_EVENTS - index;
+		}
+		ssize_t size = count * sizeof(trace_event_t);
+		ok = write(fd, &ring->event[index], size) == size;
+		done += count;
 	}
-	printf("\n");
+	int error = ok ? 0 : (errno != 0 ? errno : EIO);
+	close(fd);
+	return error;
 }
+#endif
 
-extern "C" void print_local_cache() {
-	for (int i = 0; i < cache_classes; i++) {
-		printf("local_class[%d]  = %p|  ", i, th->local_cache[i]);
+// Returns NULL if there is no memory
+extern "C" void *memory_alloc(size_t size) {
+	void *mem = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
 	}
-	printf("\n");
+	atmc_add64(&os_stats.mmaps, 1);
+	atmc_add64(&os_stats.mapped, size);
+	return mem;
 }
 
-extern "C" void print_global_cache() {
-	for (int i = 0; i < cache_classes; i++) {
-		printf("global_class[%d] = %p|  ", i, global_cache[i]);
+extern "C" void memory_dealloc(void* mem, size_t size) {
+	if (munmap(mem, size) == -1) { handle_error("munmap failed"); }
+	atmc_add64(&os_stats.munmaps, 1);
+	atmc_add64(&os_stats.mapped, -(unsigned long long)size);
+}
+
+// Maps size bytes at address, only if nothing is mapped there
+// Returns NULL if it can't
+extern "C" void *memory_alloc_at(void *address, size_t size) {
+	void *mem = mmap(address, size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+	if (mem == MAP_FAILED) {
+		return NULL;
 	}
-	printf("\n");
+	atmc_add64(&os_stats.mmaps, 1);
+	atmc_add64(&os_stats.mapped, size);
+	// Kernels before 4.17 take the address only as a hint
+	if (mem != address) {
+		memory_dealloc(mem, size);
+		return NULL;
+	}
+	return mem;
 }
 
-// Given the size return the memory_class that it belongs to
-extern "C" int get_memory_class(size_t size) {
-	int memory_class = 0;
-	size--;
-	while(size > 3) {
-		size = size>>1;
-		memory_class++;
+// Gives the pages of mem back to the OS, the range stays mapped
+// Returns 1 if the memory is zero after that, MADV_FREE may keep the data
+extern "C" int memory_purge(void *mem, size_t size) {
+	atmc_add64(&os_stats.purges, 1);
+	#ifdef MEMORYLIB_PURGE_LAZY
+	// Kernels before 4.5 don't have MADV_FREE
+	if (madvise(mem, size, MADV_FREE) == 0) {
+		return 0;
 	}
-	return memory_class;
+	#endif
+	if (madvise(mem, size, MADV_DONTNEED) == -1) { handle_error("madvise failed"); }
+	return 1;
 }
 
-extern "C" void print_pg_block_header(pg_block_header_t *pg_block_header) {
-	printf("pg_block_header: %p|  unallocated_objects: %4u|  freed_objects: %4u, remotely_freed_LIFO %d|\n",
-	pg_block_header, pg_block_header->unallocated_objects,
-	pg_block_header->freed_objects,
-	(pg_block_header->remotely_freed_LIFO == NULL ||
-		pg_block_header->remotely_freed_LIFO == (void*)1)?0:1);
-	printf("freed_LIFO: ");
-	if (get_memory_class(pg_block_header->object_size) == 0) {
-		print_pseudo_LIFO(pg_block_header->freed_LIFO);
+// Allocates size bytes alligned to allignment, which is a power of two
+// Maps more than needed and unmaps the excess on both sides
+extern "C" void *memory_alloc_aligned(size_t size, size_t allignment) {
+	size_t excess = allignment - pg_size;
+	char *mem = (char*)memory_alloc(size + excess);
+	if (mem == NULL) {
+		return NULL;
 	}
-	else {
-		print_LIFO(pg_block_header->freed_LIFO);
+	char *alligned = (char*)(((unsigned long)mem + allignment - 1) &
+		~(allignment - 1));
+	if (alligned != mem) {
+		memory_dealloc(mem, alligned - mem);
 	}
-	printf("remotely_freed_LIFO: ");
-	if (get_memory_class(pg_block_header->object_size) == 0) {
-		print_pseudo_LIFO(pg_block_header->remotely_freed_LIFO);
+	if (alligned + size != mem + size + excess) {
+		memory_dealloc(alligned + size, mem + size + excess - (alligned + size));
 	}
-	else {
-		print_LIFO(pg_block_header->remotely_freed_LIFO);
+	return alligned;
+}
+
+// Returns the pg_map leaf that covers the address, NULL if there is none
+// If create is set, a missing leaf is allocated
+extern "C" volatile unsigned long *pg_map_get_leaf(unsigned long address,
+	int create) {
+	unsigned long root_index = address >> (PG_MAP_SHIFT + PG_MAP_LEAF_BITS);
+	if (root_index >= (1UL << PG_MAP_ROOT_BITS)) {
+		return NULL;
+	}
+
+	volatile unsigned long *leaf = pg_map[root_index];
+	if (leaf == NULL && create) {
+		// Leaves are never freed, if someone installed it first use theirs
+		void *new_leaf = memory_alloc(PG_MAP_LEAF_SIZE);
+		if (new_leaf == NULL) { handle_error("mmap failed"); }
+		if (compare_and_swap_ptr(&pg_map[root_index], NULL, new_leaf) == 0) {
+			memory_dealloc(new_leaf, PG_MAP_LEAF_SIZE);
+		}
+		leaf = pg_map[root_index];
 	}
+	return leaf;
 }
 
-extern "C" void print_less_pg_block_header(pg_block_header_t *pg_block_header) {
-	printf("pg_block_header: %p|  unallocated_objects: %4u|  freed_objects: %4u|  remotely_freed_LIFO %d|\n",
-	pg_block_header, pg_block_header->unallocated_objects,
-	pg_block_header->freed_objects,
-	(pg_block_header->remotely_freed_LIFO == NULL ||
-		pg_block_header->remotely_freed_LIFO == (void*)1)?0:1);
+// Returns the pg_map entry of the page that ptr points to
+extern "C" unsigned long pg_map_get(void *ptr) {
+	unsigned long address = (unsigned long)ptr;
+	volatile unsigned long *leaf = pg_map_get_leaf(address, 0);
+	if (leaf == NULL) {
+		return 0;
+	}
+	return leaf[(address >> PG_MAP_SHIFT) & ((1UL << PG_MAP_LEAF_BITS) - 1)];
 }
 
-extern "C" void print_heap() {
-	printf("--------------- Heap ---------------\n");
-	for (int i = 0; i < CLASSES; i++) {
-		if (th->heap[i].size == 0)
+// Sets the pg_map entry of every page in [start, start + size)
+extern "C" void pg_map_set(void *start, size_t size, unsigned long entry) {
+	unsigned long address = (unsigned long)start;
+	unsigned long end = address + size;
+	for (; address < end; address += 1UL << PG_MAP_SHIFT) {
+		volatile unsigned long *leaf = pg_map_get_leaf(address, entry != 0);
+		if (leaf == NULL) {
 			continue;
-		printf("th: %ld, class: %d, object_size: %d, obj_in_pg_block: %d, pg_blocks: %d\n",
-			th->id, i, class_info[i].memory_size, class_info[i].obj_in_pg_block,
-			th->heap[i].size);
-		pg_block_header_t *pg_block_header = (pg_block_header_t*)
-			list_get_front(&th->heap[i]);
-		for (int j = 0; j < th->heap[i].size; j++) {
-			printf("th: %ld, pg_block: %2d|  ",th->id, j);
-			print_pg_block_header(pg_block_header);
-			pg_block_header = (pg_block_header_t*)list_get_next(pg_block_header);
 		}
+		leaf[(address >> PG_MAP_SHIFT) & ((1UL << PG_MAP_LEAF_BITS) - 1)] = entry;
 	}
-	printf("------------------------------------\n");
 }
 
-extern "C" void print_less_heap() {
-	printf("--------------- Heap ---------------\n");
-	for (int i = 0; i < CLASSES; i++) {
-		if (th->heap[i].size == 0)
-			continue;
-		printf("th: %ld, class: %d, object_size: %d, obj_in_pg_block: %d, pg_blocks: %d\n",
-			th->id, i, class_info[i].memory_size, class_info[i].obj_in_pg_block,
-			th->heap[i].size);
-		pg_block_header_t *pg_block_header = (pg_block_header_t*)
-			list_get_front(&th->heap[i]);
-		for (int j = 0; j < th->heap[i].size; j++) {
-			printf("th: %ld, pg_block: %2d|  ",th->id, j);
-			print_less_pg_block_header(pg_block_header);
-			pg_block_header = (pg_block_header_t*)list_get_next(pg_block_header);
+struct bootstrap {
+	pthread_mutex_t lock;
+	char *ptr;														// Next free byte of the current chunk
+	char *end;														// End of the current chunk
+	char *start;													// The reserved range, NULL until it is used
+	char *limit;
+	char *next_chunk;
+	volatile int outside;									// Chunks were mapped out of the range
+};
+typedef struct bootstrap bootstrap_t;
+bootstrap_t bootstrap = { PTHREAD_MUTEX_INITIALIZER };
+
+// Returns a chunk of size bytes for the bootstrap arena, from the reserved
+// range while it lasts, with bootstrap.lock held
+// Returns NULL if there is no memory
+extern "C" char *bootstrap_chunk(size_t size) {
+	if (bootstrap.start == NULL) {
+		char *start = (char*)memory_alloc(BOOTSTRAP_RESERVE);
+		if (start != NULL) {
+			pg_map_set(start, BOOTSTRAP_RESERVE, PG_MAP_BOOTSTRAP);
+			bootstrap.next_chunk = start;
+			bootstrap.limit = start + BOOTSTRAP_RESERVE;
+			bootstrap.start = start;
 		}
 	}
-	printf("------------------------------------\n");
-}
+	if (bootstrap.start != NULL &&
+		size <= (size_t)(bootstrap.limit - bootstrap.next_chunk)) {
+		char *chunk = bootstrap.next_chunk;
+		bootstrap.next_chunk += size;
+		return chunk;
+	}
 
-extern "C" int pseudo_lifo_size(void *lifo) {
-	int size = 0;
-	while (lifo != NULL) {
-		size++;
-		lifo = pseudo_ptr_to_ptr((int*)lifo);
+	char *chunk = (char*)memory_alloc(size);
+	if (chunk != NULL) {
+		pg_map_set(chunk, size, PG_MAP_BOOTSTRAP);
+		bootstrap.outside = 1;
 	}
-	return size;
+	return chunk;
 }
 
-extern "C" int lifo_size(void *lifo) {
-	int size = 0;
-	while (lifo != NULL) {
-		size++;
-		lifo = *(void**)lifo;
+// Allocates size bytes aligned to allignment from the bootstrap arena
+// Returns NULL if there is no memory
+extern "C" void *bootstrap_alloc(size_t size, size_t allignment) {
+	if (allignment < BOOTSTRAP_HEADER_SIZE) {
+		allignment = BOOTSTRAP_HEADER_SIZE;
 	}
-	return size;
+	if (size > MAX_SIZE_LARGE_OBJ || allignment > MAX_SIZE_LARGE_OBJ) {
+		return NULL;
+	}
+	size = (size + BOOTSTRAP_HEADER_SIZE - 1) & ~(BOOTSTRAP_HEADER_SIZE - 1);
+	size_t needed = BOOTSTRAP_HEADER_SIZE + allignment + size;
+
+	char *ptr, *end;
+	pthread_mutex_lock(&bootstrap.lock);
+	if (needed > BOOTSTRAP_CHUNK_SIZE / 4 ||
+		needed > (size_t)(bootstrap.end - bootstrap.ptr)) {
+		// Big objects get their own chunk, the others a new shared one
+		size_t chunk_size = (needed > BOOTSTRAP_CHUNK_SIZE / 4) ?
+			(needed + pg_size - 1) & ~((size_t)pg_size - 1) : BOOTSTRAP_CHUNK_SIZE;
+		char *chunk = bootstrap_chunk(chunk_size);
+		if (chunk == NULL) {
+			pthread_mutex_unlock(&bootstrap.lock);
+			return NULL;
+		}
+		ptr = chunk;
+		end = chunk + chunk_size;
+		if (chunk_size == BOOTSTRAP_CHUNK_SIZE) {
+			bootstrap.ptr = chunk;
+			bootstrap.end = end;
+		}
+	}
+	else {
+		ptr = bootstrap.ptr;
+		end = bootstrap.end;
+	}
+
+	char *obj = (char*)(((unsigned long)ptr + BOOTSTRAP_HEADER_SIZE +
+		allignment - 1) & ~(allignment - 1));
+	if (end == bootstrap.end) {
+		bootstrap.ptr = obj + size;
+	}
+	pthread_mutex_unlock(&bootstrap.lock);
+
+	*(size_t*)(obj - BOOTSTRAP_HEADER_SIZE) = size;
+	return obj;
 }
 
-extern "C" void *atomic_empty_lifo(volatile void** address) {
-	void *old_ptr = *(void**)address;
-	void *new_ptr = NULL;
+// Returns the list node of a large_span
+extern "C" void *large_span_to_node(large_span_t *span) {
+	return &span->next;
+}
 
-	while (compare_and_swap_ptr(address, old_ptr, new_ptr) == 0) {
-		//#ifdef MEMORYLIB_DEBUG
-		printf("atomic_empty_lifo: compare_and_swap failed, retry: %p\n", old_ptr);
-		//#endif
-		old_ptr = *(void**)address;
-	}
+// Returns the large_span of a list node
+extern "C" large_span_t *node_to_large_span(void *node) {
+	return (large_span_t*)((char*)node - 2 * sizeof(size_t));
+}
 
-	return old_ptr;
+// Returns the page right after the span
+extern "C" void *large_span_end(large_span_t *span) {
+	return (char*)span + span->number_of_pages * pg_size;
 }
 
-extern "C" void *atomic_pop(volatile void** address) {
-	void *old_ptr, *new_ptr;
-	do {
+// Sets the pg_map entries of the first and the last page of the span,
+// which is enough to find the span from an object and from its neighbours
+extern "C" void large_span_set_map(large_span_t *span, unsigned long tag) {
+	unsigned long entry = (unsigned long)span | tag;
+	pg_map_set(span, 1, entry);
+	pg_map_set((char*)large_span_end(span) - pg_size, 1, entry);
+}
+
+// Returns the bin of large_cache that holds spans of number_of_pages
+extern "C" list_t *large_cache_bin(size_t number_of_pages) {
+	if (number_of_pages > LARGE_SPAN_MAX_PAGES) {
+		return &large_cache.huge_bin;
+	}
+	return &large_cache.bin[number_of_pages - 1];
+}
+
+// Removes a free span from large_cache, lock must be held
+extern "C" void large_cache_remove(large_span_t *span) {
+	list_remove(large_cache_bin(span->number_of_pages), large_span_to_node(span));
+	large_cache.free_pages -= span->number_of_pages;
+}
+
+// Inserts a free span to large_cache after coalescing it with its free
+// neighbours, or returns it to the OS if large_cache is full
+// Lock must be held
+extern "C" void large_cache_insert(large_span_t *span) {
+	// Coalesce with the previous span
+	unsigned long entry = pg_map_get((char*)span - pg_size);
+	if ((entry & PG_MAP_TAG_MASK) == PG_MAP_FREE_SPAN) {
+		large_span_t *prev = (large_span_t*)(entry & ~PG_MAP_TAG_MASK);
+		large_cache_remove(prev);
+		prev->number_of_pages += span->number_of_pages;
+		span = prev;
+	}
+
+	// Coalesce with the next span
+	entry = pg_map_get(large_span_end(span));
+	if ((entry & PG_MAP_TAG_MASK) == PG_MAP_FREE_SPAN &&
+		(void*)(entry & ~PG_MAP_TAG_MASK) == large_span_end(span)) {
+		large_span_t *next = (large_span_t*)(entry & ~PG_MAP_TAG_MASK);
+		large_cache_remove(next);
+		span->number_of_pages += next->number_of_pages;
+	}
+
+	if (large_cache.free_pages + span->number_of_pages > LARGE_CACHE_MAX_PAGES) {
+		// Return memory to OS
+		pg_map_set(span, span->number_of_pages * pg_size, 0);
+		memory_dealloc(span, span->number_of_pages * pg_size);
+		return;
+	}
+
+	large_span_set_map(span, PG_MAP_FREE_SPAN);
+	list_insert_front(large_cache_bin(span->number_of_pages),
+		large_span_to_node(span));
+	large_cache.free_pages += span->number_of_pages;
+}
+
+// Gets a span of number_of_pages from large_cache, growing it from the OS
+// if there is no free span big enough
+// Returns NULL if there is no memory
+extern "C" large_span_t *large_cache_alloc(size_t number_of_pages) {
+	large_span_t *span = NULL;
+
+	pthread_mutex_lock(&large_cache.lock);
+	// Best fit from the bins, first fit from the huge_bin
+	for (size_t i = number_of_pages; i <= LARGE_SPAN_MAX_PAGES; i++) {
+		if (!list_is_empty(&large_cache.bin[i - 1])) {
+			span = node_to_large_span(list_get_front(&large_cache.bin[i - 1]));
+			break;
+		}
+	}
+	if (span == NULL && !list_is_empty(&large_cache.huge_bin)) {
+		void *node = list_get_front(&large_cache.huge_bin);
+		for (int i = 0; i < large_cache.huge_bin.size; i++) {
+			if (node_to_large_span(node)->number_of_pages >= number_of_pages) {
+				span = node_to_large_span(node);
+				break;
+			}
+			node = list_get_next(node);
+		}
+	}
+
+	if (span != NULL) {
+		large_cache_remove(span);
+	}
+	else {
+		// Allocate memory from OS
+		// Don't grow more than large_cache can keep
+		size_t grow_pages = number_of_pages;
+		if (grow_pages < LARGE_SPAN_GROW_PAGES && large_cache.free_pages +
+			LARGE_SPAN_GROW_PAGES - grow_pages <= LARGE_CACHE_MAX_PAGES) {
+			grow_pages = LARGE_SPAN_GROW_PAGES;
+		}
+		span = (large_span_t*)memory_alloc(grow_pages * pg_size);
+		if (span == NULL) {
+			pthread_mutex_unlock(&large_cache.lock);
+			return NULL;
+		}
+		span->number_of_pages = grow_pages;
+	}
+
+	// Give back what is not needed
+	// The span must be mapped as allocated first, so the rest doesn't
+	// coalesce with it
+	size_t rest_pages = span->number_of_pages - number_of_pages;
+	span->number_of_pages = number_of_pages;
+	large_span_set_map(span, PG_MAP_LARGE);
+	if (rest_pages > 0) {
+		large_span_t *rest = (large_span_t*)large_span_end(span);
+		rest->number_of_pages = rest_pages;
+		large_cache_insert(rest);
+	}
+	pthread_mutex_unlock(&large_cache.lock);
+
+	return span;
+}
+
+// Gives every span of a thread's large_local_cache to the shared large_cache
+extern "C" void large_cache_flush(list_t *local_bin, size_t *local_pages) {
+	pthread_mutex_lock(&large_cache.lock);
+	for (int i = 0; i < LARGE_LOCAL_SPAN_MAX_PAGES; i++) {
+		void *node;
+		while ((node = list_remove_front(&local_bin[i])) != NULL) {
+			large_cache_insert(node_to_large_span(node));
+		}
+	}
+	TRACE(TRACE_CACHE_FLUSH, NULL, TRACE_NO_CLASS, *local_pages);
+	*local_pages = 0;
+	pthread_mutex_unlock(&large_cache.lock);
+}
+
+// Allocates a large_span of number_of_pages from the OS, its memory is zero
+// Returns NULL if there is no memory
+extern "C" large_span_t *large_span_map(size_t number_of_pages) {
+	large_span_t *span = (large_span_t*)memory_alloc(number_of_pages * pg_size);
+	if (span == NULL) {
+		return NULL;
+	}
+	span->number_of_pages = number_of_pages;
+	large_span_set_map(span, PG_MAP_LARGE);
+	return span;
+}
+
+// Allocates a large_span of number_of_pages
+// Checks the thread's large_local_cache, then the shared large_cache
+extern "C" large_span_t *large_span_alloc(size_t number_of_pages) {
+	large_span_t *span;
+
+	if (number_of_pages > LARGE_SPAN_MAX_PAGES) {
+		// Too big to be cached, allocate memory from OS
+		span = large_span_map(number_of_pages);
+	}
+	else if (number_of_pages <= LARGE_LOCAL_SPAN_MAX_PAGES &&
+		!list_is_empty(&th->large_local_cache[number_of_pages - 1])) {
+		// Check local cache, the span is already mapped as PG_MAP_LARGE
+		span = node_to_large_span(list_remove_front(
+			&th->large_local_cache[number_of_pages - 1]));
+		th->large_local_cache_pages -= number_of_pages;
+	}
+	else {
+		span = large_cache_alloc(number_of_pages);
+	}
+
+	return span;
+}
+
+// Allocates a large_span of number_of_pages whose second page is aligned to
+// allignment, a power of two bigger than pg_size
+// A span allignment / pg_size - 1 pages bigger is carved, the pages before
+// and after the aligned span go back to the caches or to the OS
+extern "C" large_span_t *large_span_alloc_aligned(size_t number_of_pages,
+	size_t allignment) {
+	size_t carved_pages = number_of_pages + allignment / pg_size - 1;
+	large_span_t *carved;
+	if (carved_pages > LARGE_SPAN_MAX_PAGES) {
+		carved = (large_span_t*)memory_alloc(carved_pages * pg_size);
+		if (carved == NULL) {
+			return NULL;
+		}
+	}
+	else {
+		carved = large_span_alloc(carved_pages);
+		if (carved == NULL) {
+			return NULL;
+		}
+	}
+
+	char *carved_end = (char*)carved + carved_pages * pg_size;
+	large_span_t *span = (large_span_t*)((((unsigned long)carved + pg_size +
+		allignment - 1) & ~(allignment - 1)) - pg_size);
+	span->number_of_pages = number_of_pages;
+	size_t front_pages = ((char*)span - (char*)carved) / pg_size;
+	size_t back_pages = (carved_end - (char*)large_span_end(span)) / pg_size;
+
+	if (carved_pages > LARGE_SPAN_MAX_PAGES) {
+		// Return memory to OS
+		if (front_pages > 0) {
+			memory_dealloc(carved, front_pages * pg_size);
+		}
+		if (back_pages > 0) {
+			memory_dealloc(large_span_end(span), back_pages * pg_size);
+		}
+		large_span_set_map(span, PG_MAP_LARGE);
+		return span;
+	}
+
+	// The span must be mapped as allocated first, so the rest doesn't
+	// coalesce with it
+	pthread_mutex_lock(&large_cache.lock);
+	large_span_set_map(span, PG_MAP_LARGE);
+	if (front_pages > 0) {
+		carved->number_of_pages = front_pages;
+		large_cache_insert(carved);
+	}
+	if (back_pages > 0) {
+		large_span_t *back = (large_span_t*)large_span_end(span);
+		back->number_of_pages = back_pages;
+		large_cache_insert(back);
+	}
+	pthread_mutex_unlock(&large_cache.lock);
+
+	return span;
+}
+
+// Caches or deallocates a large_span
+extern "C" void large_span_free(large_span_t *span) {
+	size_t number_of_pages = span->number_of_pages;
+
+	if (number_of_pages > LARGE_SPAN_MAX_PAGES) {
+		// Return memory to OS, aligned objects may have mapped any page
+		pg_map_set(span, number_of_pages * pg_size, 0);
+		memory_dealloc(span, number_of_pages * pg_size);
+		return;
+	}
+
+	if (number_of_pages <= LARGE_LOCAL_SPAN_MAX_PAGES && th != NULL) {
+		// Check if the span can be cached locally
+		if (th->large_local_cache_pages + number_of_pages >
+			LARGE_LOCAL_CACHE_MAX_PAGES) {
+			// Move the whole local tier to the shared one with one lock
+			large_cache_flush(th->large_local_cache, &th->large_local_cache_pages);
+		}
+		list_insert_front(&th->large_local_cache[number_of_pages - 1],
+			large_span_to_node(span));
+		th->large_local_cache_pages += number_of_pages;
+		return;
+	}
+
+	pthread_mutex_lock(&large_cache.lock);
+	large_cache_insert(span);
+	pthread_mutex_unlock(&large_cache.lock);
+}
+
+// Moves or resizes an allocated span with mremap, the pages aren't copied
+// Returns the span, which may have moved, or NULL if the OS can't do it
+extern "C" large_span_t *large_span_remap(large_span_t *span,
+	size_t number_of_pages) {
+	size_t span_pages = span->number_of_pages;
+	size_t old_size = span_pages * pg_size;
+
+	// Pages that are unmapped must lose their entries before another thread
+	// can map them again
+	pg_map_set(span, old_size, 0);
+	large_span_t *new_span = (large_span_t*)mremap(span, old_size,
+		number_of_pages * pg_size, MREMAP_MAYMOVE);
+	if (new_span == MAP_FAILED) {
+		large_span_set_map(span, PG_MAP_LARGE);
+		return NULL;
+	}
+
+	atmc_add64(&os_stats.mremaps, 1);
+	atmc_add64(&os_stats.mapped, (number_of_pages - span_pages) * pg_size);
+	new_span->number_of_pages = number_of_pages;
+	large_span_set_map(new_span, PG_MAP_LARGE);
+	return new_span;
+}
+
+// Resizes an allocated span to number_of_pages without copying its pages
+// Spans too big to be cached are resized with mremap. Cached spans shrink by
+// giving their tail back to the caches and grow by taking the free span right
+// after them from large_cache
+// Returns the span, which may have moved, or NULL if it can't be resized,
+// spans that cross LARGE_SPAN_MAX_PAGES must be copied
+extern "C" large_span_t *large_span_resize(large_span_t *span,
+	size_t number_of_pages) {
+	size_t old_pages = span->number_of_pages;
+
+	if (number_of_pages == old_pages) {
+		return span;
+	}
+	else if (number_of_pages > LARGE_SPAN_MAX_PAGES &&
+		old_pages > LARGE_SPAN_MAX_PAGES) {
+		return large_span_remap(span, number_of_pages);
+	}
+	else if (number_of_pages > LARGE_SPAN_MAX_PAGES ||
+		old_pages > LARGE_SPAN_MAX_PAGES) {
+		// Remapping would punch holes in the caches or leave small mappings
+		// behind them
+		return NULL;
+	}
+	else if (number_of_pages < old_pages) {
+		// The span must be mapped first, so the tail doesn't coalesce with it
+		span->number_of_pages = number_of_pages;
+		large_span_set_map(span, PG_MAP_LARGE);
+		large_span_t *rest = (large_span_t*)large_span_end(span);
+		rest->number_of_pages = old_pages - number_of_pages;
+		large_span_set_map(rest, PG_MAP_LARGE);
+		large_span_free(rest);
+		return span;
+	}
+
+	pthread_mutex_lock(&large_cache.lock);
+	unsigned long entry = pg_map_get(large_span_end(span));
+	large_span_t *next = (large_span_t*)(entry & ~PG_MAP_TAG_MASK);
+	if ((entry & PG_MAP_TAG_MASK) != PG_MAP_FREE_SPAN ||
+		(void*)next != large_span_end(span) ||
+		next->number_of_pages < number_of_pages - old_pages) {
+		pthread_mutex_unlock(&large_cache.lock);
+		return NULL;
+	}
+	large_cache_remove(next);
+	size_t rest_pages = next->number_of_pages - (number_of_pages - old_pages);
+	span->number_of_pages = number_of_pages;
+	large_span_set_map(span, PG_MAP_LARGE);
+	if (rest_pages > 0) {
+		large_span_t *rest = (large_span_t*)large_span_end(span);
+		rest->number_of_pages = rest_pages;
+		large_cache_insert(rest);
+	}
+	pthread_mutex_unlock(&large_cache.lock);
+
+	return span;
+}
+
+// If u want to print ptr in binary pass the size and the pointer to ptr
+extern "C" void printBits(size_t const size, void const *ptr) {
+	unsigned char *b = (unsigned char*) ptr;
+	unsigned char byte;
+	int i, j;
+	for (i = size-1; i >= 0; i--) {
+		for (j = 7; j >= 0; j--) {
+			byte = (b[i] >> j) & 1;
+			printf("%u", byte);
+		}
+		putchar(' ');
+	}
+	puts("");
+}
+
+extern "C" void print_memory_class(unsigned int memory_class) {
+	printf("---------- Memory Class %u ----------\n", memory_class);
+	printf("memory_size: %u\n", class_info[memory_class].memory_size);
+	printf("pg_block_size: %u\n", class_info[memory_class].pg_block_size);
+	printf("obj_in_pg_block: %u\n", class_info[memory_class].obj_in_pg_block);
+	printf("wasted_obj_pg_header: %u\n", class_info[memory_class].wasted_obj_pg_header);
+	printf("wasted_bytes: %u\n", class_info[memory_class].wasted_bytes);
+	printf("cache_class: %u\n", class_info[memory_class].cache_class);
+	printf("local_cache_high: %u\n", class_info[memory_class].local_cache_high);
+	printf("local_cache_low: %u\n", class_info[memory_class].local_cache_low);
+	printf("allignment: %u\n", class_info[memory_class].allignment);
+	printf("------------------------------------\n");
+}
+
+// Returns 4 Byte-pseudo ptr
+extern "C" int ptr_to_pseudo_ptr(void *ptr) {
+	return ((long int)ptr & UINT_MAX);
+}
+
+// Returns 4 Byte-pseudo ptr
+extern "C" void *pseudo_ptr_to_ptr(int *pseudo_ptr) {
+	if (*pseudo_ptr == 0)
+		return NULL;
+	return (void*) (
+		((long unsigned int)pseudo_ptr & ((long unsigned int)~0 - UINT_MAX)) +
+		*(unsigned int*)pseudo_ptr
+	);
+}
+
+// Returns the head of a packed remotely_freed_LIFO
+extern "C" void *remote_lifo_ptr(volatile void *lifo) {
+	return (void*)((unsigned long)lifo & REMOTE_LIFO_PTR_MASK);
+}
+
+// Returns the number of objects of a packed remotely_freed_LIFO
+extern "C" unsigned int remote_lifo_count(volatile void *lifo) {
+	return (unsigned long)lifo >> REMOTE_LIFO_COUNT_SHIFT;
+}
+
+// Packs the head and the number of objects of a remotely_freed_LIFO
+extern "C" void *remote_lifo_pack(void *ptr, unsigned int count) {
+	return (void*)((unsigned long)ptr | ((unsigned long)count << REMOTE_LIFO_COUNT_SHIFT));
+}
+
+extern "C" void print_pseudo_LIFO(volatile void *lifo) {
+	int i = 0;
+	while (lifo != NULL && lifo != (void*)1) {
+		if (i < MAX_PRINT_LIFO)
+			printf("%p->", lifo);
+		else if (i == MAX_PRINT_LIFO + 1)
+			printf(".....->");
+		lifo = pseudo_ptr_to_ptr((int*)lifo);
+		i++;
+	}
+	printf("%p\n", lifo);
+}
+
+extern "C" void print_LIFO(volatile void *lifo) {
+	int i = 0;
+	while (lifo != NULL && lifo != (void*)1) {
+		if (i < MAX_PRINT_LIFO)
+			printf("%p->", lifo);
+		else if (i == MAX_PRINT_LIFO + 1)
+			printf(".....->");
+		lifo = *(void**)lifo;
+		i++;
+	}
+	printf("%p\n", lifo);
+}
+
+extern "C" void print_large_objs() {
+	printf("--------------- large_objs ---------------\n");
+	printf("large_objects: %u\n", large_objects);
+	printf("large_cache free_pages: %lu\n", large_cache.free_pages);
+	if (th != NULL) {
+		printf("large_local_cache pages: %lu\n", th->large_local_cache_pages);
+	}
+}
+
+extern "C" void print_local_cache() {
+	for (int i = 0; i < cache_classes; i++) {
+		printf("local_class[%d]  = ", i);
+		pg_block_header_t *pg_block_header = (pg_block_header_t*)
+			list_get_front(&th->local_cache[i]);
+		for (int j = 0; j < th->local_cache[i].size; j++) {
+			printf("%p->", pg_block_header);
+			pg_block_header = (pg_block_header_t*)list_get_next(pg_block_header);
+		}
+		printf("(nil)|  ");
+	}
+	printf("\n");
+}
+
+extern "C" void print_global_cache() {
+	for (int i = 0; i < cache_classes; i++) {
+		printf("global_class[%d] = ", i);
+		for (int shard = 0; shard < GLOBAL_CACHE_SHARDS; shard++) {
+			unsigned int index = global_cache[i][shard].used & UINT_MAX;
+			while (index != 0) {
+				printf("%p->", global_cache[i][shard].slot[index - 1].pg_block_header);
+				index = global_cache[i][shard].slot[index - 1].next;
+			}
+		}
+		printf("(nil)|  ");
+	}
+	printf("\n");
+}
+
+// Given the size return the memory_class that it belongs to
+extern "C" int get_memory_class(size_t size) {
+	return class_table.size_to_class[(size + 3) >> 2];
+}
+
+extern "C" void print_pg_block_header(pg_block_header_t *pg_block_header) {
+	printf("pg_block_header: %p|  unallocated_objects: %4u|  freed_objects: %4u, remotely_freed_LIFO %d|\n",
+	pg_block_header, pg_block_header->unallocated_objects,
+	pg_block_header->freed_objects,
+	(pg_block_header->remotely_freed_LIFO == NULL ||
+		pg_block_header->remotely_freed_LIFO == (void*)1)?0:1);
+	printf("freed_LIFO: ");
+	if (pg_block_header->memory_class == 0) {
+		print_pseudo_LIFO(pg_block_header->freed_LIFO);
+	}
+	else {
+		print_LIFO(pg_block_header->freed_LIFO);
+	}
+	printf("remotely_freed_LIFO (%u objects): ",
+		remote_lifo_count(pg_block_header->remotely_freed_LIFO));
+	if (pg_block_header->memory_class == 0) {
+		print_pseudo_LIFO(remote_lifo_ptr(pg_block_header->remotely_freed_LIFO));
+	}
+	else {
+		print_LIFO(remote_lifo_ptr(pg_block_header->remotely_freed_LIFO));
+	}
+}
+
+extern "C" void print_less_pg_block_header(pg_block_header_t *pg_block_header) {
+	printf("pg_block_header: %p|  unallocated_objects: %4u|  freed_objects: %4u|  remotely_freed_LIFO %d|\n",
+	pg_block_header, pg_block_header->unallocated_objects,
+	pg_block_header->freed_objects,
+	(pg_block_header->remotely_freed_LIFO == NULL ||
+		pg_block_header->remotely_freed_LIFO == (void*)1)?0:1);
+}
+
+extern "C" void print_heap() {
+	printf("--------------- Heap ---------------\n");
+	const char *bin_name[HEAP_BINS] = { "full", "mostly_full", "mostly_empty" };
+	for (int i = 0; i < CLASSES; i++) {
+		int pg_blocks = 0;
+		for (int bin = 0; bin < HEAP_BINS; bin++)
+			pg_blocks += th->heap[i][bin].size;
+		if (pg_blocks == 0)
+			continue;
+		printf("th: %ld, class: %d, object_size: %d, obj_in_pg_block: %d, pg_blocks: %d\n",
+			th->id, i, class_info[i].memory_size, class_info[i].obj_in_pg_block,
+			pg_blocks);
+		for (int bin = 0; bin < HEAP_BINS; bin++) {
+			pg_block_header_t *pg_block_header = (pg_block_header_t*)
+				list_get_front(&th->heap[i][bin]);
+			for (int j = 0; j < th->heap[i][bin].size; j++) {
+				printf("th: %ld, %s pg_block: %2d|  ",th->id, bin_name[bin], j);
+				print_pg_block_header(pg_block_header);
+				pg_block_header = (pg_block_header_t*)list_get_next(pg_block_header);
+			}
+		}
+	}
+	printf("------------------------------------\n");
+}
+
+extern "C" void print_less_heap() {
+	printf("--------------- Heap ---------------\n");
+	const char *bin_name[HEAP_BINS] = { "full", "mostly_full", "mostly_empty" };
+	for (int i = 0; i < CLASSES; i++) {
+		int pg_blocks = 0;
+		for (int bin = 0; bin < HEAP_BINS; bin++)
+			pg_blocks += th->heap[i][bin].size;
+		if (pg_blocks == 0)
+			continue;
+		printf("th: %ld, class: %d, object_size: %d, obj_in_pg_block: %d, pg_blocks: %d\n",
+			th->id, i, class_info[i].memory_size, class_info[i].obj_in_pg_block,
+			pg_blocks);
+		for (int bin = 0; bin < HEAP_BINS; bin++) {
+			pg_block_header_t *pg_block_header = (pg_block_header_t*)
+				list_get_front(&th->heap[i][bin]);
+			for (int j = 0; j < th->heap[i][bin].size; j++) {
+				printf("th: %ld, %s pg_block: %2d|  ",th->id, bin_name[bin], j);
+				print_less_pg_block_header(pg_block_header);
+				pg_block_header = (pg_block_header_t*)list_get_next(pg_block_header);
+			}
+		}
+	}
+	printf("------------------------------------\n");
+}
+
+extern "C" int pseudo_lifo_size(void *lifo) {
+	int size = 0;
+	while (lifo != NULL) {
+		size++;
+		lifo = pseudo_ptr_to_ptr((int*)lifo);
+	}
+	return size;
+}
+
+extern "C" int lifo_size(void *lifo) {
+	int size = 0;
+	while (lifo != NULL) {
+		size++;
+		lifo = *(void**)lifo;
+	}
+	return size;
+}
+
+extern "C" void *atomic_empty_lifo(volatile void** address) {
+	void *old_ptr = *(void**)address;
+	void *new_ptr = NULL;
+
+	while (compare_and_swap_ptr(address, old_ptr, new_ptr) == 0) {
+		stats_cas_retry(address);
+		old_ptr = *(void**)address;
+	}
+
+	return old_ptr;
+}
+
+extern "C" void *atomic_pop(volatile void** address) {
+	void *old_ptr, *new_ptr;
+	do {
 		old_ptr = *(void**)address;
 		if (old_ptr == NULL)
 			return NULL;
@@ -412,9 +1723,6 @@ extern "C" void *pseudo_atomic_pop(void** address) {
 	int *new_ptr = (int*)pseudo_ptr_to_ptr((int*)old_ptr);
 
 	while (compare_and_swap_ptr(address, old_ptr, new_ptr) == 0) {
-		#ifdef MEMORYLIB_DEBUG
-		printf("pseudo_atomic_pop: compare_and_swap failed, retry: %p\n", old_ptr);
-		#endif
 		old_ptr = *address;
 		new_ptr = (int*)pseudo_ptr_to_ptr((int*)old_ptr);
 	}
@@ -427,9 +1735,6 @@ extern "C" void *atomic_push(volatile void** address, void* new_ptr) {
 	*(void**)new_ptr = old_ptr;
 
 	while (compare_and_swap_ptr(address, old_ptr, new_ptr) == 0) {
-		//#ifdef MEMORYLIB_DEBUG
-		printf("atomic_push: compare_and_swap failed, retry: %p\n", new_ptr);
-		//#endif
 		old_ptr = *(void**)address;
 		*(void**)new_ptr = old_ptr;
 	}
@@ -437,177 +1742,1025 @@ extern "C" void *atomic_push(volatile void** address, void* new_ptr) {
 	return old_ptr;
 }
 
-extern "C" void *pseudo_atomic_push(void** address, void* new_ptr) {
-	void *old_ptr = *address;
-	*(int*)new_ptr = ptr_to_pseudo_ptr(old_ptr);
+extern "C" void *pseudo_atomic_push(void** address, void* new_ptr) {
+	void *old_ptr = *address;
+	*(int*)new_ptr = ptr_to_pseudo_ptr(old_ptr);
+
+	while (compare_and_swap_ptr(address, old_ptr, new_ptr) == 0) {
+		old_ptr = *address;
+		*(int*)new_ptr = ptr_to_pseudo_ptr(old_ptr);
+	}
+
+	return old_ptr;
+}
+
+// Returns the pointer to pg_block_header
+extern "C" pg_block_header_t *pg_block_to_pg_block_header(void *pg_block) {
+	return (pg_block_header_t*)pg_block;
+}
+
+// Returns the pointer to pg_block
+extern "C" void *pg_block_header_to_pg_block
+	(pg_block_header_t *pg_block_header) {
+	return (void*)pg_block_header;
+}
+
+// Returns 1 if pg_block is full, 0 if it's not full
+extern "C" int pg_block_is_full(pg_block_header_t *pg_block_header) {
+	if (pg_block_header->freed_objects == 0 &&
+		pg_block_header->unallocated_objects == 0 &&
+		pg_block_header->remotely_freed_LIFO == NULL) {
+			return 1;
+	}
+	return 0;
+}
+
+// Returns 1 if pg_block is empty, 0 if it's not empty
+// The objects in the remotely_freed_LIFO are counted without collecting them
+extern "C" int pg_block_is_empty(pg_block_header_t *pg_block_header) {
+	if (pg_block_header->freed_objects + pg_block_header->unallocated_objects +
+		remote_lifo_count(pg_block_header->remotely_freed_LIFO) ==
+		class_info[pg_block_header->memory_class].obj_in_pg_block) {
+			return 1;
+	}
+	return 0;
+}
+
+// Moves the remotely_freed_LIFO in front of the freed_LIFO
+// The LIFO carries its number of objects, so when the freed_LIFO is empty,
+// which is the case when allocating, no object is touched
+extern "C" void pg_block_collect_remote(pg_block_header_t *pg_block_header) {
+	if (pg_block_header->remotely_freed_LIFO == NULL) {
+		return;
+	}
+	void *lifo = atomic_empty_lifo(&pg_block_header->remotely_freed_LIFO);
+	void *head = remote_lifo_ptr(lifo);
+
+	if (pg_block_header->freed_LIFO != NULL) {
+		// Find the tail, to link the freed_LIFO after it
+		void *tail = head;
+		if (pg_block_header->memory_class == 0) {
+			// Special case if obj_size is 4 bytes
+			while (pseudo_ptr_to_ptr((int*)tail) != NULL) {
+				tail = pseudo_ptr_to_ptr((int*)tail);
+			}
+			*(int*)tail = ptr_to_pseudo_ptr(pg_block_header->freed_LIFO);
+		}
+		else {
+			while (*(void**)tail != NULL) {
+				tail = *(void**)tail;
+			}
+			*(void**)tail = pg_block_header->freed_LIFO;
+		}
+	}
+	pg_block_header->freed_LIFO = head;
+	pg_block_header->freed_objects += remote_lifo_count(lifo);
+}
+
+// Initializes pg_block and pg_block_header
+extern "C" void pg_block_init(pg_block_header_t *pg_block_header,
+	int memory_class) {
+	// Only the first page is touched, the rest are faulted in when
+	// unallocated_ptr reaches them
+	void *pg_block = pg_block_header_to_pg_block(pg_block_header);
+
+	// Initialize pg_block_header fields
+	pg_block_header->next = NULL;
+	pg_block_header->prev = NULL;
+	pg_block_header->list = NULL;
+	pg_block_header->remotely_freed_LIFO = NULL;
+	pg_block_header->id = th->id;
+	pg_block_header->object_size = class_info[memory_class].memory_size;
+	pg_block_header->memory_class = memory_class;
+	pg_block_header->unallocated_ptr = (char*)pg_block + class_info[memory_class].
+		memory_size * class_info[memory_class].wasted_obj_pg_header;
+	// A cached pg_block keeps untouched_ptr from its previous use
+	pg_block_header->freed_LIFO = NULL;
+	pg_block_header->unallocated_objects = class_info[memory_class].
+		obj_in_pg_block;
+	pg_block_header->freed_objects = 0;
+	pg_block_header->sampled_objects = 0;
+}
+
+// Pops a slot index from a tagged stack of a global_cache shard
+// Returns -1 if the stack is empty
+extern "C" int tagged_stack_pop(volatile unsigned long long *head,
+	global_cache_slot_t *slot) {
+	unsigned long long old_head, new_head;
+	unsigned int index;
+	while (1) {
+		old_head = *head;
+		index = old_head & UINT_MAX;
+		if (index == 0) {
+			return -1;
+		}
+		new_head = (((old_head >> 32) + 1) << 32) | slot[index - 1].next;
+		if (compare_and_swap64(head, old_head, new_head) != 0) {
+			return index - 1;
+		}
+		stats_cas_retry(head);
+	}
+}
+
+// Pushes a slot index to a tagged stack of a global_cache shard
+extern "C" void tagged_stack_push(volatile unsigned long long *head,
+	global_cache_slot_t *slot, int index) {
+	unsigned long long old_head, new_head;
+	while (1) {
+		old_head = *head;
+		slot[index].next = old_head & UINT_MAX;
+		new_head = (((old_head >> 32) + 1) << 32) | (index + 1);
+		if (compare_and_swap64(head, old_head, new_head) != 0) {
+			return;
+		}
+		stats_cas_retry(head);
+	}
+}
+
+// Returns the global_cache shard of the calling thread's cpu group
+extern "C" int global_cache_shard() {
+	int cpu = sched_getcpu();
+	if (cpu < 0) {
+		return 0;
+	}
+	return (cpu / CPUS_PER_SHARD) % GLOBAL_CACHE_SHARDS;
+}
+
+// Takes a pg_block from a global_cache shard, NULL if there is none
+extern "C" pg_block_header_t *global_cache_shard_pop(
+	global_cache_shard_t *shard) {
+	int index = tagged_stack_pop(&shard->used, shard->slot);
+	if (index < 0) {
+		return NULL;
+	}
+	pg_block_header_t *pg_block_header = shard->slot[index].pg_block_header;
+	tagged_stack_push(&shard->free, shard->slot, index);
+	return pg_block_header;
+}
+
+// Gives a pg_block to a global_cache shard, returns 0 if the shard is full
+extern "C" int global_cache_shard_push(global_cache_shard_t *shard,
+	pg_block_header_t *pg_block_header) {
+	int index = tagged_stack_pop(&shard->free, shard->slot);
+	if (index < 0) {
+		// Take a slot that was never used
+		if (shard->unused_slots >= GLOBAL_CACHE_DEPTH) {
+			return 0;
+		}
+		index = atmc_fetch_and_add(&shard->unused_slots, 1) - 1;
+		if (index >= GLOBAL_CACHE_DEPTH) {
+			return 0;
+		}
+	}
+	shard->slot[index].pg_block_header = pg_block_header;
+	tagged_stack_push(&shard->used, shard->slot, index);
+	return 1;
+}
+
+// Takes a pg_block of cache_class from the global_cache, own shard first
+extern "C" pg_block_header_t *global_cache_pop(int cache_class) {
+	int shard = global_cache_shard();
+	for (int i = 0; i < GLOBAL_CACHE_SHARDS; i++) {
+		pg_block_header_t *pg_block_header = global_cache_shard_pop(
+			&global_cache[cache_class][(shard + i) % GLOBAL_CACHE_SHARDS]);
+		if (pg_block_header != NULL) {
+			return pg_block_header;
+		}
+	}
+	return NULL;
+}
+
+// Gives a pg_block of cache_class to the global_cache, own shard first
+// Returns 0 if every shard is full
+extern "C" int global_cache_push(int cache_class,
+	pg_block_header_t *pg_block_header) {
+	int shard = global_cache_shard();
+	for (int i = 0; i < GLOBAL_CACHE_SHARDS; i++) {
+		if (global_cache_shard_push(
+			&global_cache[cache_class][(shard + i) % GLOBAL_CACHE_SHARDS],
+			pg_block_header)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static_assert(MAX_PG_BLOCK_SIZE / MIN_PG_BLOCK_SIZE < 64 &&
+	SUPERBLOCK_UNITS % 64 == 0, "A pg_block must fit in one word of units");
+
+// Returns the bits of units units starting from unit first, in their word
+extern "C" unsigned long superblock_mask(unsigned int first, unsigned int units) {
+	return ((1UL << units) - 1) << (first % 64);
+}
+
+// Returns the first unit of a free run of 2^order units, aligned to its size,
+// or -1 if the superblock has none, with the lock of its shard held
+extern "C" int superblock_run(superblock_t *superblock, int order) {
+	unsigned int units = 1 << order;
+	for (int i = 0; i < SUPERBLOCK_UNITS / 64; i++) {
+		// A bit stays set if the units after it are free too
+		unsigned long free = ~superblock->used[i];
+		for (unsigned int shift = 1; shift < units; shift <<= 1) {
+			free &= free >> shift;
+		}
+		// Keep the units a pg_block of this size may start at, 1 every units
+		free &= ~0UL / ((1UL << units) - 1);
+		if (free != 0) {
+			return i * 64 + __builtin_ctzl(free);
+		}
+	}
+	return -1;
+}
+
+// Moves a superblock to the partial list of its largest free run, or out of
+// them if it is full, with the lock of its shard held
+// A superblock whose largest run doesn't change keeps its place, the older
+// ones at the front are filled first
+extern "C" void superblock_file(superblock_t *superblock) {
+	superblock_shard_t *shard = &superblock_shards[superblock->shard];
+	list_t *list = NULL;
+	for (int order = SUPERBLOCK_ORDERS - 1; order >= 0 && list == NULL; order--) {
+		if (superblock_run(superblock, order) >= 0) {
+			list = &shard->partial[order];
+		}
+	}
+	if (superblock->list == list) {
+		return;
+	}
+	if (superblock->list != NULL) {
+		list_remove(superblock->list, superblock);
+	}
+	if (list != NULL) {
+		list_insert_back(list, superblock);
+	}
+}
+
+// Maps a new superblock, with superblock_manager.lock held
+// Returns NULL if there is no memory
+extern "C" superblock_t *superblock_map() {
+	superblock_t *superblock = superblock_manager.free_descriptors;
+	if (superblock != NULL) {
+		superblock_manager.free_descriptors = superblock->next_free;
+	}
+	else {
+		if (superblock_manager.chunk_left < sizeof(superblock_t)) {
+			superblock_manager.chunk = (char*)memory_alloc(SUPERBLOCK_CHUNK);
+			if (superblock_manager.chunk == NULL) {
+				superblock_manager.chunk_left = 0;
+				return NULL;
+			}
+			superblock_manager.chunk_left = SUPERBLOCK_CHUNK;
+		}
+		superblock = (superblock_t*)superblock_manager.chunk;
+		superblock_manager.chunk += sizeof(superblock_t);
+		superblock_manager.chunk_left -= sizeof(superblock_t);
+	}
+
+	// Right below the last superblock, mmap fills the address space
+	// downwards, so that the kernel merges their VMAs
+	superblock->base = NULL;
+	if (superblock_manager.hint != NULL) {
+		superblock->base = (char*)memory_alloc_at(superblock_manager.hint,
+			SUPERBLOCK_SIZE);
+	}
+	if (superblock->base == NULL) {
+		superblock->base = (char*)memory_alloc_aligned(SUPERBLOCK_SIZE,
+			SUPERBLOCK_SIZE);
+	}
+	if (superblock->base == NULL) {
+		superblock->next_free = superblock_manager.free_descriptors;
+		superblock_manager.free_descriptors = superblock;
+		return NULL;
+	}
+	superblock_manager.hint = superblock->base - SUPERBLOCK_SIZE;
+	superblock->next = NULL;
+	superblock->prev = NULL;
+	superblock->list = NULL;
+	superblock->free_units = SUPERBLOCK_UNITS;
+	memset(superblock->used, 0, sizeof(superblock->used));
+	memset(superblock->dirty, 0, sizeof(superblock->dirty));
+	memset(superblock->purged, 0, sizeof(superblock->purged));
+	superblock_manager.superblocks++;
+	return superblock;
+}
+
+// Unmaps a free superblock that is in no list, without any lock held
+extern "C" void superblock_unmap(superblock_t *superblock) {
+	memory_dealloc(superblock->base, SUPERBLOCK_SIZE);
+	pthread_mutex_lock(&superblock_manager.lock);
+	superblock_manager.superblocks--;
+	superblock->next_free = superblock_manager.free_descriptors;
+	superblock_manager.free_descriptors = superblock;
+	pthread_mutex_unlock(&superblock_manager.lock);
+}
+
+// Returns the retained superblock with the lowest address, or the highest if
+// highest is set, with superblock_manager.lock held
+// The lowest ones are reused and the highest unmapped, so that the heap
+// stays together in few VMAs
+extern "C" superblock_t *superblock_retained_pick(int highest) {
+	superblock_t *pick = (superblock_t*)list_get_front(
+		&superblock_manager.retained);
+	superblock_t *superblock = pick;
+	for (int i = 1; i < superblock_manager.retained.size; i++) {
+		superblock = (superblock_t*)list_get_next(superblock);
+		if ((superblock->base > pick->base) == (highest != 0)) {
+			pick = superblock;
+		}
+	}
+	return pick;
+}
+
+// Takes a free superblock, the spare, the lowest retained or a new one
+// Returns NULL if there is no memory
+extern "C" superblock_t *superblock_get() {
+	superblock_t *superblock;
+	int mapped = 0;
+	pthread_mutex_lock(&superblock_manager.lock);
+	if (superblock_manager.spare != NULL) {
+		superblock = superblock_manager.spare;
+		superblock_manager.spare = NULL;
+	}
+	else if (!list_is_empty(&superblock_manager.retained)) {
+		superblock = superblock_retained_pick(0);
+		list_remove(&superblock_manager.retained, superblock);
+	}
+	else {
+		superblock = superblock_map();
+		mapped = superblock_manager.superblocks;
+	}
+	pthread_mutex_unlock(&superblock_manager.lock);
+
+	// Only a hint, the kernel may not have huge pages
+	if (superblock != NULL && mapped >= SUPERBLOCK_HUGE_MIN) {
+		madvise(superblock->base, SUPERBLOCK_SIZE, MADV_HUGEPAGE);
+	}
+	return superblock;
+}
+
+// Keeps a free superblock that isn't the spare, without any lock held
+// Its pages are purged but it stays mapped, up to SUPERBLOCK_RETAINED_MAX
+// superblocks, then the highest one is unmapped
+extern "C" void superblock_retain(superblock_t *superblock) {
+	for (int i = 0; i < SUPERBLOCK_UNITS / 64; i++) {
+		atmc_add64(&superblock_manager.dirty_units, -(unsigned long long)
+			__builtin_popcountl(superblock->dirty[i] & ~superblock->purged[i]));
+		superblock->purged[i] = superblock->dirty[i];
+	}
+	if (memory_purge(superblock->base, SUPERBLOCK_SIZE)) {
+		memset(superblock->dirty, 0, sizeof(superblock->dirty));
+		memset(superblock->purged, 0, sizeof(superblock->purged));
+	}
+
+	superblock_t *highest = NULL;
+	pthread_mutex_lock(&superblock_manager.lock);
+	list_insert_front(&superblock_manager.retained, superblock);
+	if (superblock_manager.retained.size > SUPERBLOCK_RETAINED_MAX) {
+		highest = superblock_retained_pick(1);
+		list_remove(&superblock_manager.retained, highest);
+	}
+	pthread_mutex_unlock(&superblock_manager.lock);
+	if (highest != NULL) {
+		superblock_unmap(highest);
+	}
+}
+
+// Gives back a free superblock that is in no list, without any lock held
+// It becomes the spare, or is retained
+extern "C" void superblock_put(superblock_t *superblock) {
+	pthread_mutex_lock(&superblock_manager.lock);
+	if (superblock_manager.spare == NULL) {
+		superblock_manager.spare = superblock;
+		superblock = NULL;
+	}
+	pthread_mutex_unlock(&superblock_manager.lock);
+	if (superblock != NULL) {
+		superblock_retain(superblock);
+	}
+}
+
+// Carves a pg_block of size bytes out of a superblock of the shard of the
+// thread, *superblock is set to it
+// *untouched is set to where the memory of the pg_block is zero from, after
+// the header
+// Returns NULL if there is no memory
+extern "C" void *superblock_alloc(size_t size, void **untouched,
+	superblock_t **superblock_ptr) {
+	unsigned int units = size / MIN_PG_BLOCK_SIZE;
+	int order = __builtin_ctz(units);
+	int shard = global_cache_shard();
+	superblock_t *superblock = NULL;
+
+	pthread_mutex_lock(&superblock_shards[shard].lock);
+	for (int i = order; i < SUPERBLOCK_ORDERS && superblock == NULL; i++) {
+		superblock = (superblock_t*)list_get_front(
+			&superblock_shards[shard].partial[i]);
+	}
+	if (superblock == NULL) {
+		// No run is big enough, take a whole superblock without the lock, it
+		// is only ours until it is in a partial list
+		pthread_mutex_unlock(&superblock_shards[shard].lock);
+		superblock = superblock_get();
+		if (superblock == NULL) {
+			return NULL;
+		}
+		superblock->shard = shard;
+		pthread_mutex_lock(&superblock_shards[shard].lock);
+	}
+
+	unsigned int first = superblock_run(superblock, order);
+	unsigned long mask = superblock_mask(first, units);
+	superblock->used[first / 64] |= mask;
+	superblock->free_units -= units;
+	// Units that were never touched, or purged with MADV_DONTNEED, are zero
+	// The dirty bits of used units are set again when they are freed
+	unsigned long dirty = superblock->dirty[first / 64] & mask;
+	unsigned long dirty_units = __builtin_popcountl(dirty &
+		~superblock->purged[first / 64]);
+	superblock->purged[first / 64] &= ~mask;
+	superblock_file(superblock);
+	pthread_mutex_unlock(&superblock_shards[shard].lock);
+	if (dirty_units != 0) {
+		atmc_add64(&superblock_manager.dirty_units, -dirty_units);
+	}
+
+	char *pg_block = superblock->base + first * MIN_PG_BLOCK_SIZE;
+	*untouched = pg_block + PG_BLOCK_HEADER_SIZE;
+	if (dirty != 0) {
+		unsigned int last = 63 - __builtin_clzl(dirty);
+		*untouched = superblock->base + ((first / 64) * 64 + last + 1) *
+			MIN_PG_BLOCK_SIZE;
+	}
+	*superblock_ptr = superblock;
+	return pg_block;
+}
+
+// Gives a pg_block of size bytes back to its superblock, the pg_map must
+// already be cleared
+// Only the units before untouched, the untouched_ptr of the pg_block, are
+// dirty, the rest are still zero
+// A superblock that becomes free is kept as spare or retained
+extern "C" void superblock_free(superblock_t *superblock, void *pg_block,
+	size_t size, void *untouched) {
+	unsigned int units = size / MIN_PG_BLOCK_SIZE;
+	unsigned int first = ((char*)pg_block - superblock->base) / MIN_PG_BLOCK_SIZE;
+	unsigned int touched_units = ((char*)untouched - (char*)pg_block +
+		MIN_PG_BLOCK_SIZE - 1) / MIN_PG_BLOCK_SIZE;
+	if (touched_units > units) {
+		touched_units = units;
+	}
+	#ifdef MEMORYLIB_DEBUG
+	if ((char*)pg_block < superblock->base ||
+		(char*)pg_block >= superblock->base + SUPERBLOCK_SIZE) {
+		handle_error("superblock_free: pg_block of another superblock");
+	}
+	#endif
+
+	superblock_shard_t *shard = &superblock_shards[superblock->shard];
+	pthread_mutex_lock(&shard->lock);
+	unsigned long mask = superblock_mask(first, units);
+	superblock->used[first / 64] &= ~mask;
+	unsigned long dirty = superblock_mask(first, touched_units);
+	superblock->dirty[first / 64] = (superblock->dirty[first / 64] & ~mask) |
+		dirty;
+	superblock->free_units += units;
+	int free = superblock->free_units == SUPERBLOCK_UNITS;
+	if (free && superblock->list != NULL) {
+		list_remove(superblock->list, superblock);
+	}
+	else if (!free) {
+		superblock_file(superblock);
+	}
+	pthread_mutex_unlock(&shard->lock);
+
+	atmc_add64(&superblock_manager.dirty_units, touched_units);
+	atmc_add64(&superblock_manager.new_dirty_units, touched_units);
+	if (free) {
+		superblock_put(superblock);
+	}
+}
+
+// No thread may hold a lock of the superblocks in a fork, the child could
+// never take it again
+extern "C" void superblock_fork_prepare() {
+	for (int shard = 0; shard < GLOBAL_CACHE_SHARDS; shard++) {
+		pthread_mutex_lock(&superblock_shards[shard].lock);
+	}
+	pthread_mutex_lock(&superblock_manager.lock);
+}
+
+extern "C" void superblock_fork_parent() {
+	pthread_mutex_unlock(&superblock_manager.lock);
+	for (int shard = 0; shard < GLOBAL_CACHE_SHARDS; shard++) {
+		pthread_mutex_unlock(&superblock_shards[shard].lock);
+	}
+}
+
+// Gives a pg_block of a finished thread that has free objects to the
+// orphan pool, its id must already be 0
+// Returns 0 if the bin is full
+extern "C" int orphan_pool_push(pg_block_header_t *pg_block_header) {
+	int memory_class = pg_block_header->memory_class;
+	unsigned int objects = class_info[memory_class].obj_in_pg_block;
+	unsigned int allocated = objects - pg_block_header->unallocated_objects -
+		pg_block_header->freed_objects;
+	int bin = allocated * ORPHAN_BINS / objects;
+	if (bin >= ORPHAN_BINS) {
+		return 0;
+	}
+
+	orphan_bin_t *orphan_bin = &orphan_pool[memory_class][bin];
+	int index = tagged_stack_pop(&orphan_bin->free, orphan_bin->slot);
+	if (index < 0) {
+		// Take a slot that was never used
+		if (orphan_bin->unused_slots >= ORPHAN_BIN_DEPTH) {
+			return 0;
+		}
+		index = atmc_fetch_and_add(&orphan_bin->unused_slots, 1) - 1;
+		if (index >= ORPHAN_BIN_DEPTH) {
+			return 0;
+		}
+	}
+	orphan_bin->slot[index].pg_block_header = pg_block_header;
+	tagged_stack_push(&orphan_bin->used, orphan_bin->slot, index);
+	return 1;
+}
+
+// Takes a pg_block of a bin of the orphan pool, NULL if it is empty
+extern "C" pg_block_header_t *orphan_bin_pop(orphan_bin_t *orphan_bin) {
+	int index = tagged_stack_pop(&orphan_bin->used, orphan_bin->slot);
+	if (index < 0) {
+		return NULL;
+	}
+	pg_block_header_t *pg_block_header = orphan_bin->slot[index].pg_block_header;
+	tagged_stack_push(&orphan_bin->free, orphan_bin->slot, index);
+	return pg_block_header;
+}
+
+// Takes the fullest pg_block of the orphan pool of memory_class, NULL if
+// there is none
+extern "C" pg_block_header_t *orphan_pool_pop(int memory_class) {
+	for (int bin = ORPHAN_BINS - 1; bin >= 0; bin--) {
+		pg_block_header_t *pg_block_header = orphan_bin_pop(
+			&orphan_pool[memory_class][bin]);
+		if (pg_block_header != NULL) {
+			return pg_block_header;
+		}
+	}
+	return NULL;
+}
+
+// Gives up a pg_block that no thread owns, its id must be 0 and its
+// remotely_freed_LIFO not 0x1. It is freed if it is empty, pooled if it has
+// free objects, or else orphaned, the thread that frees the next object to
+// it adopts it
+extern "C" void pg_block_orphan(pg_block_header_t *pg_block_header) {
+	do {
+		// Move remotely_freed_LIFO to freed_LIFO
+		pg_block_collect_remote(pg_block_header);
+		if (pg_block_header->unallocated_objects + pg_block_header->freed_objects ==
+			class_info[pg_block_header->memory_class].obj_in_pg_block) {
+			pg_block_free(pg_block_header);
+			return;
+		}
+		// Give it to the threads that allocate, if it has free objects
+		if (orphan_pool_push(pg_block_header)) {
+			return;
+		}
+		// Objects freed meanwhile are collected again, otherwise mark the
+		// remotely_freed_LIFO 0x1 - orphaned
+	} while (compare_and_swap_ptr(&pg_block_header->remotely_freed_LIFO,
+		NULL, (void*)1) == 0);
+}
+
+// PgManager Allocates memory for memory_class pg_block
+extern "C" pg_block_header *pg_block_alloc(int memory_class) {
+	// Check to see if there is available pg_block in global_cache
+	pg_block_header_t *pg_block_header = global_cache_pop(
+		class_info[memory_class].cache_class);
+	if (pg_block_header != NULL) {
+		th->stats.global_cache_hits++;
+		TRACE(TRACE_BLOCK_ALLOC, pg_block_header, memory_class, TRACE_GLOBAL_CACHE);
+		return pg_block_header;
+	}
+	// Otherwise, carve it out of a superblock
+	th->stats.global_cache_misses++;
+	void *untouched;
+	superblock_t *superblock;
+	void *pg_block = superblock_alloc(class_info[memory_class].pg_block_size,
+		&untouched, &superblock);
+	if (pg_block == NULL) {
+		return NULL;
+	}
+	pg_block_header = pg_block_to_pg_block_header(pg_block);
+	pg_block_header->untouched_ptr = untouched;
+	pg_block_header->superblock = superblock;
+	pg_map_set(pg_block, class_info[memory_class].pg_block_size,
+		class_info[memory_class].pg_block_size | PG_MAP_SMALL);
+	TRACE(TRACE_BLOCK_ALLOC, pg_block_header, memory_class, TRACE_OS);
+
+	return pg_block_header;
+}
+
+// PgManager caches or deallocates a pg_block
+extern "C" void pg_block_free(pg_block_header_t* pg_block_header) {
+	void* pg_block = pg_block_header_to_pg_block(pg_block_header);
+	int memory_class = pg_block_header->memory_class;
+
+	// Check if the pg_block can be cached globally
+	if (decay.ms != 0) {
+		pg_block_header->idle_epoch = decay.epoch;
+	}
+	if (global_cache_push(class_info[memory_class].cache_class, pg_block_header)) {
+		TRACE(TRACE_BLOCK_FREE, pg_block_header, memory_class, TRACE_GLOBAL_CACHE);
+		return;
+	}
+	// Otherwise, give it back to its superblock
+	TRACE(TRACE_BLOCK_FREE, pg_block_header, memory_class, TRACE_OS);
+	pg_map_set(pg_block, class_info[memory_class].pg_block_size, 0);
+	superblock_free(pg_block_header->superblock, pg_block,
+		class_info[memory_class].pg_block_size, pg_block_header->untouched_ptr);
+}
+
+// Purges the free units of a superblock that hold pages, until
+// superblock_manager.dirty_units is limit, with the lock of its shard held or
+// taken out of the spare
+extern "C" void decay_purge_superblock(superblock_t *superblock, size_t limit) {
+	unsigned int first = 0;
+	while (first < SUPERBLOCK_UNITS && superblock_manager.dirty_units > limit) {
+		// Find the next run of units to purge, runs end at a word
+		unsigned long *dirty = &superblock->dirty[first / 64];
+		unsigned long *purged = &superblock->purged[first / 64];
+		unsigned long candidates = (*dirty & ~superblock->used[first / 64] &
+			~*purged) >> (first % 64);
+		if (candidates == 0) {
+			first = (first / 64 + 1) * 64;
+			continue;
+		}
+		first += __builtin_ctzl(candidates);
+		unsigned long run = candidates >> __builtin_ctzl(candidates);
+		unsigned int units = ~run == 0 ? 64 : __builtin_ctzl(~run);
+		if (units > superblock_manager.dirty_units - limit) {
+			units = superblock_manager.dirty_units - limit;
+		}
 
-	while (compare_and_swap_ptr(address, old_ptr, new_ptr) == 0) {
-		//#ifdef MEMORYLIB_DEBUG
-		printf("pseudo_atomic_push: compare_and_swap failed, retry: %p\n", new_ptr);
-		//#endif
-		old_ptr = *address;
-		*(int*)new_ptr = ptr_to_pseudo_ptr(old_ptr);
+		unsigned long mask = units == 64 ? ~0UL : superblock_mask(first, units);
+		if (memory_purge(superblock->base + first * MIN_PG_BLOCK_SIZE,
+			units * MIN_PG_BLOCK_SIZE)) {
+			*dirty &= ~mask;
+		}
+		else {
+			*purged |= mask;
+		}
+		atmc_add64(&superblock_manager.dirty_units, -(unsigned long long)units);
+		decay.purged_units += units;
+		first += units;
 	}
+}
 
-	return old_ptr;
+// Gives an idle pg_block back to its superblock
+extern "C" void decay_release(pg_block_header_t *pg_block_header) {
+	void *pg_block = pg_block_header_to_pg_block(pg_block_header);
+	size_t pg_block_size = class_info[pg_block_header->memory_class].
+		pg_block_size;
+	pg_map_set(pg_block, pg_block_size, 0);
+	superblock_free(pg_block_header->superblock, pg_block, pg_block_size,
+		pg_block_header->untouched_ptr);
 }
 
-// Returns the pointer to pg_block_header
-extern "C" pg_block_header_t *pg_block_to_pg_block_header(void *pg_block) {
-	pg_block_header_t *pg_block_header =
-		(pg_block_header_t*)((char*)pg_block + sizeof(void*));
-	return pg_block_header;
+// Publishes the chain of remote frees of a slot of another thread, an
+// orphaned pg_block is taken and added to orphans, to give it up again
+extern "C" void decay_remote_flush(remote_free_t *remote_free, list_t *orphans) {
+	pg_block_header_t *pg_block_header = remote_free->pg_block_header;
+	if (pg_block_header == NULL) {
+		return;
+	}
+	while (!remote_free_publish(remote_free)) {
+		if (compare_and_swap_ptr(&pg_block_header->remotely_freed_LIFO, (void*)1,
+			NULL) != 0) {
+			list_insert_front(orphans, pg_block_header);
+		}
+	}
 }
 
-// Returns the pointer to pg_block
-extern "C" void *pg_block_header_to_pg_block
-	(pg_block_header_t *pg_block_header) {
-	void *pg_block = (char*)pg_block_header - sizeof(void*);
-	return pg_block;
+// Gives the pg_blocks idle in the local_cache of every thread back to their
+// superblock and publishes the remote frees of every thread, a thread that
+// uses them now is left for the next tick
+// The registry keeps the threads alive while they are taken, the superblocks
+// are locked after it is released
+extern "C" void decay_threads() {
+	list_t idle, orphans;
+	list_init(&idle);
+	list_init(&orphans);
+	pthread_mutex_lock(&stats_registry.lock);
+	void *node = list_get_front(&stats_registry.threads);
+	for (int i = 0; i < stats_registry.threads.size; i++) {
+		struct thread *thread = ((stats_node_t*)node)->thread;
+		node = list_get_next(node);
+		if (!compare_and_swap32(&thread->busy, BUSY_FREE, BUSY_HELD)) {
+			continue;
+		}
+		for (int cache_class = 0; cache_class < cache_classes; cache_class++) {
+			list_t *local_cache = &thread->local_cache[cache_class];
+			// The least recently used pg_blocks are in the back
+			while (!list_is_empty(local_cache) &&
+				decay.epoch - ((pg_block_header_t*)list_get_back(local_cache))->
+				idle_epoch >= DECAY_STEPS) {
+				list_insert_front(&idle, list_remove_back(local_cache));
+			}
+		}
+		for (int slot = 0; slot < REMOTE_FREE_SLOTS; slot++) {
+			decay_remote_flush(&thread->remote_free[slot], &orphans);
+		}
+		thread->remote_free_ops = 0;
+		fetch_and_store(&thread->busy, BUSY_FREE);
+	}
+	pthread_mutex_unlock(&stats_registry.lock);
+
+	while (!list_is_empty(&idle)) {
+		decay_release((pg_block_header_t*)list_remove_front(&idle));
+	}
+	while (!list_is_empty(&orphans)) {
+		pg_block_orphan((pg_block_header_t*)list_remove_front(&orphans));
+	}
 }
 
-// Returns 1 if pg_block is full, 0 if it's not full
-extern "C" int pg_block_is_full(pg_block_header_t *pg_block_header) {
-	if (pg_block_header->freed_objects == 0 &&
-		pg_block_header->unallocated_objects == 0 &&
-		pg_block_header->remotely_freed_LIFO == NULL) {
-			return 1;
+// Gives the pg_blocks of the global_cache that were idle for the decay time
+// back to their superblocks
+extern "C" void decay_global_cache() {
+	for (int cache_class = 0; cache_class < cache_classes; cache_class++) {
+		for (int i = 0; i < GLOBAL_CACHE_SHARDS; i++) {
+			global_cache_shard_t *shard = &global_cache[cache_class][i];
+			// Take them all, the stack has the newest on top, and put the
+			// rest back in the same order
+			pg_block_header_t *kept[GLOBAL_CACHE_DEPTH];
+			int kept_blocks = 0;
+			for (int j = 0; j < GLOBAL_CACHE_DEPTH; j++) {
+				pg_block_header_t *pg_block_header = global_cache_shard_pop(shard);
+				if (pg_block_header == NULL) {
+					break;
+				}
+				if (decay.epoch - pg_block_header->idle_epoch < DECAY_STEPS) {
+					kept[kept_blocks++] = pg_block_header;
+					continue;
+				}
+				decay_release(pg_block_header);
+			}
+			while (kept_blocks > 0) {
+				pg_block_header_t *pg_block_header = kept[--kept_blocks];
+				if (!global_cache_shard_push(shard, pg_block_header)) {
+					// Other threads filled the shard meanwhile
+					pg_block_free(pg_block_header);
+				}
+			}
+		}
 	}
-	return 0;
 }
 
-// Returns 1 if pg_block is full, 0 if it's not full
-extern "C" int pg_block_is_empty(pg_block_header_t *pg_block_header) {
-	if (pg_block_header->freed_objects + pg_block_header->unallocated_objects ==
-		class_info[get_memory_class(pg_block_header->object_size)].obj_in_pg_block
-		&& pg_block_header->remotely_freed_LIFO == NULL) {
-			return 1;
+// Takes every pg_block of the orphan pool and gives it up again, a pooled
+// pg_block belongs to no thread, so nobody else notices when remote frees
+// empty it
+extern "C" void decay_orphan_pool() {
+	list_t pooled;
+	list_init(&pooled);
+	for (int memory_class = 0; memory_class < CLASSES; memory_class++) {
+		for (int bin = 0; bin < ORPHAN_BINS; bin++) {
+			pg_block_header_t *pg_block_header;
+			while ((pg_block_header = orphan_bin_pop(
+				&orphan_pool[memory_class][bin])) != NULL) {
+				list_insert_back(&pooled, pg_block_header);
+			}
+		}
+		while (!list_is_empty(&pooled)) {
+			pg_block_orphan((pg_block_header_t*)list_remove_front(&pooled));
+		}
 	}
-	return 0;
 }
 
-// Initializes pg_block and pg_block_header
-extern "C" void pg_block_init(pg_block_header_t *pg_block_header,
-	int memory_class) {
-	// The first 8 bytes of every page in a pg_block are a pointer
-	// to the pg_block_header
-	// The pg_block_header is located in the first page of the pg_block,
-	// after the 8 bytes pointer
-	void *pg_block = pg_block_header_to_pg_block(pg_block_header);
+// A tick of the scavenger
+extern "C" void decay_tick() {
+	decay.epoch++;
+	decay_threads();
+	decay_orphan_pool();
+	decay_global_cache();
 
-	// Initialize pg_block_header fields
-	pg_block_header->next = NULL;
-	pg_block_header->prev = NULL;
-	pg_block_header->remotely_freed_LIFO = NULL;
-	pg_block_header->id = th->id;
-	pg_block_header->object_size = class_info[memory_class].memory_size;
-	pg_block_header->unallocated_ptr = (char*)pg_block + class_info[memory_class].
-		memory_size * class_info[memory_class].wasted_obj_pg_header;
-	pg_block_header->freed_LIFO = NULL;
-	pg_block_header->unallocated_objects = class_info[memory_class].
-		obj_in_pg_block;
-	pg_block_header->freed_objects = 0;
+	unsigned long long new_dirty_units;
+	do {
+		new_dirty_units = superblock_manager.new_dirty_units;
+	} while (compare_and_swap64(&superblock_manager.new_dirty_units,
+		new_dirty_units, 0) == 0);
+	memmove(&decay.backlog[1], &decay.backlog[0],
+		(DECAY_STEPS - 1) * sizeof(size_t));
+	decay.backlog[0] = new_dirty_units;
+	size_t limit = 0;
+	for (int i = 0; i < DECAY_STEPS; i++) {
+		limit += decay.backlog[i] * (DECAY_STEPS - i) / DECAY_STEPS;
+	}
 
-	// Write the ptr to the pg_block_header at the start of every pg
-	// TODO: Optimization, pointer is 16KB alligned
-	for (unsigned int i = 0; i < class_info[memory_class].number_of_pages; i++) {
-		pg_block_header_t **ptr = (pg_block_header_t**) ((char*)pg_block + i * pg_size);
-		*ptr = pg_block_header;
+	// The spare first, it is taken out so that no lock is held while it is
+	// purged
+	pthread_mutex_lock(&superblock_manager.lock);
+	superblock_t *spare = superblock_manager.spare;
+	superblock_manager.spare = NULL;
+	pthread_mutex_unlock(&superblock_manager.lock);
+	if (spare != NULL) {
+		decay_purge_superblock(spare, limit);
+		superblock_put(spare);
+	}
+	// Then the superblocks with the largest runs, the newest of them first,
+	// they are filled last
+	for (int shard = 0; shard < GLOBAL_CACHE_SHARDS &&
+		superblock_manager.dirty_units > limit; shard++) {
+		pthread_mutex_lock(&superblock_shards[shard].lock);
+		for (int order = SUPERBLOCK_ORDERS - 1; order >= 0; order--) {
+			list_t *partial = &superblock_shards[shard].partial[order];
+			superblock_t *superblock = (superblock_t*)list_get_back(partial);
+			for (int i = 0; i < partial->size &&
+				superblock_manager.dirty_units > limit; i++) {
+				decay_purge_superblock(superblock, limit);
+				superblock = (superblock_t*)list_get_prev(superblock);
+			}
+		}
+		pthread_mutex_unlock(&superblock_shards[shard].lock);
 	}
 }
 
-// PgManager Allocates memory for memory_class pg_block
-extern "C" pg_block_header *pg_block_alloc(int memory_class) {
-	// Check to see if there is available pg_block in global_cache
-	pg_block_header_t *old_ptr;
-	if ((old_ptr = global_cache[class_info[memory_class].cache_class]) != NULL) {
-		if (compare_and_swap_ptr(&global_cache[class_info[memory_class].cache_class]
-			, old_ptr, NULL) != 0) {
-			return old_ptr;
+// The scavenger
+extern "C" void *decay_thread(void *arg) {
+	while (1) {
+		size_t ms = decay.ms;
+		struct timespec sleep;
+		if (ms == 0) {
+			ms = DECAY_OFF_SLEEP_MS;
+		}
+		else {
+			ms = (ms + DECAY_STEPS - 1) / DECAY_STEPS;
+		}
+		sleep.tv_sec = ms / 1000;
+		sleep.tv_nsec = (ms % 1000) * 1000000;
+		nanosleep(&sleep, NULL);
+		if (decay.ms != 0) {
+			decay_tick();
 		}
 	}
-	// Otherwise, allocate memory from OS
-	void *pg_block = memory_alloc(class_info[memory_class].pg_block_size);
+	return NULL;
+}
 
-	return pg_block_to_pg_block_header(pg_block);
+// Only the thread that forked runs in the child, start a new scavenger
+extern "C" void decay_fork_child() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, decay_thread, NULL) == 0) {
+		pthread_detach(thread);
+	}
 }
 
-// PgManager caches or deallocates a pg_block
-extern "C" void pg_block_free(pg_block_header_t* pg_block_header) {
-	void* pg_block = pg_block_header_to_pg_block(pg_block_header);
-	int memory_class = get_memory_class(pg_block_header->object_size);
+// Starts the scavenger, once
+extern "C" void decay_start() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, decay_thread, NULL) != 0) {
+		return;
+	}
+	pthread_detach(thread);
+	pthread_atfork(NULL, NULL, decay_fork_child);
+}
 
-	// Check if the pg_block can be cached globally
-	pg_block_header_t *old_ptr;
-	if ((old_ptr = global_cache[class_info[memory_class].cache_class]) == NULL) {
-		if (compare_and_swap_ptr(&global_cache[class_info[memory_class].cache_class]
-			, old_ptr, pg_block_header) != 0) {
-			return;
-		}
+// Returns the heap bin of the pg_block, by its occupancy
+extern "C" int heap_bin(pg_block_header_t *pg_block_header) {
+	unsigned int available = pg_block_header->unallocated_objects +
+		pg_block_header->freed_objects;
+	if (available == 0)
+		return HEAP_FULL;
+	if (available <= class_info[pg_block_header->memory_class].obj_in_pg_block / 2)
+		return HEAP_MOSTLY_FULL;
+	return HEAP_MOSTLY_EMPTY;
+}
+
+// Moves the pg_block to the heap bin of its occupancy, if it isn't there
+extern "C" void heap_update(pg_block_header_t *pg_block_header) {
+	list_t *bin = &th->heap[pg_block_header->memory_class][
+		heap_bin(pg_block_header)];
+	if (pg_block_header->list != bin) {
+		if (pg_block_header->list != NULL)
+			list_remove(pg_block_header->list, pg_block_header);
+		list_insert_front(bin, pg_block_header);
 	}
-	// Otherwise, return memory to OS
-	memory_dealloc(pg_block, class_info[memory_class].pg_block_size);
 }
 
-// Returns a pg_block that is not full
+// Returns a pg_block that is not full, NULL if there is no memory
 extern "C" pg_block_header *get_pg_block(int memory_class) {
-	// Get the first pg_block
-	pg_block_header_t *pg_block_header = (pg_block_header_t*)list_get_front(
-		&th->heap[memory_class]);
-	// Check if there are no pg_blocks or if the pg_block is full
-	// (just in case that I allocate an orphaned pg_block
-	// that is already being used and is full, check again if its full )
-	while (list_is_empty(&th->heap[memory_class]) || pg_block_is_full(pg_block_header)) {
-		if (th->local_cache[class_info[memory_class].cache_class] != NULL) {
-			// Check local cache
-			pg_block_header = th->local_cache[class_info[memory_class].cache_class];
-			th->local_cache[class_info[memory_class].cache_class] = NULL;
+	list_t *heap = th->heap[memory_class];
+
+	// Prefer the fullest pg_blocks
+	if (!list_is_empty(&heap[HEAP_MOSTLY_FULL])) {
+		return (pg_block_header_t*)list_get_front(&heap[HEAP_MOSTLY_FULL]);
+	}
+	if (!list_is_empty(&heap[HEAP_MOSTLY_EMPTY])) {
+		return (pg_block_header_t*)list_get_front(&heap[HEAP_MOSTLY_EMPTY]);
+	}
+
+	// Check if some full pg_blocks got objects back from other threads
+	for (int i = 0; i < HEAP_FULL_SCAN && !list_is_empty(&heap[HEAP_FULL]); i++) {
+		pg_block_header_t *pg_block_header = (pg_block_header_t*)list_remove_front(
+			&heap[HEAP_FULL]);
+		if (pg_block_header->remotely_freed_LIFO == NULL) {
+			list_insert_back(&heap[HEAP_FULL], pg_block_header);
+			continue;
 		}
-		else {
-			// Allocate pg_block
-			pg_block_header = pg_block_alloc(memory_class);
+		pg_block_collect_remote(pg_block_header);
+		if (pg_block_is_empty(pg_block_header)) {
+			return_pg_block(pg_block_header);
+			continue;
 		}
-		pg_block_init(pg_block_header, memory_class);
+		heap_update(pg_block_header);
+		return pg_block_header;
+	}
 
-		list_insert_front(&th->heap[memory_class], pg_block_header);
+	// Adopt a pg_block of a finished thread
+	pg_block_header_t *pg_block_header = orphan_pool_pop(memory_class);
+	if (pg_block_header != NULL) {
+		pg_block_header->id = th->id;
+		th->stats.orphan_adoptions++;
+		TRACE(TRACE_ADOPT, pg_block_header, memory_class, 0);
+		pg_block_collect_remote(pg_block_header);
+		if (!pg_block_is_empty(pg_block_header)) {
+			heap_update(pg_block_header);
+			return pg_block_header;
+		}
+		// All of its objects were freed meanwhile, it is reused from the
+		// local_cache
+		return_pg_block(pg_block_header);
+	}
 
-		pg_block_header = (pg_block_header_t*)list_get_front(
-			&th->heap[memory_class]);
+	// Check local cache, unless the scavenger drains it
+	pg_block_header = NULL;
+	if (thread_busy_take(th)) {
+		if (!list_is_empty(&th->local_cache[class_info[memory_class].cache_class])) {
+			pg_block_header = (pg_block_header_t*)list_remove_front(
+				&th->local_cache[class_info[memory_class].cache_class]);
+		}
+		thread_busy_give(th);
+	}
+	if (pg_block_header != NULL) {
+		th->stats.local_cache_hits++;
+		TRACE(TRACE_BLOCK_ALLOC, pg_block_header, memory_class, TRACE_LOCAL_CACHE);
+	}
+	else {
+		// Allocate pg_block
+		th->stats.local_cache_misses++;
+		pg_block_header = pg_block_alloc(memory_class);
+		if (pg_block_header == NULL) {
+			return NULL;
+		}
 	}
+	pg_block_init(pg_block_header, memory_class);
+	heap_update(pg_block_header);
 
 	return pg_block_header;
 }
 
 // Frees memory for pg_block
 extern "C" void return_pg_block(pg_block_header_t* pg_block_header) {
-	int memory_class = get_memory_class(pg_block_header->object_size);
+	int memory_class = pg_block_header->memory_class;
+
+	list_t *local_cache = &th->local_cache[class_info[memory_class].cache_class];
 
-	// Check if the pg_block can be cached locally
-	if (th->local_cache[class_info[memory_class].cache_class] == NULL) {
-		th->local_cache[class_info[memory_class].cache_class] = pg_block_header;
+	// The scavenger drains the local_cache, the pg_block goes to the
+	// global_cache
+	if (!thread_busy_take(th)) {
+		pg_block_free(pg_block_header);
 		return;
 	}
-	// Return memory to OS
-	pg_block_free(pg_block_header);
-}
 
-// Given a pointer the function returns the address of the address page
-extern "C" void *get_address_pg(void *ptr) {
-	long int pg_mask = ~(pg_size-1);
-	return ((void*)((long int)ptr & pg_mask));
+	// Cache the pg_block locally, the most recently used one is in front
+	if (decay.ms != 0) {
+		pg_block_header->idle_epoch = decay.epoch;
+	}
+	list_insert_front(local_cache, pg_block_header);
+	TRACE(TRACE_BLOCK_FREE, pg_block_header, memory_class, TRACE_LOCAL_CACHE);
+
+	// Past the high watermark move the least recently used pg_blocks to the
+	// global cache, or return them to OS, until the low watermark
+	if ((unsigned int)local_cache->size > class_info[memory_class].local_cache_high) {
+		while ((unsigned int)local_cache->size >
+			class_info[memory_class].local_cache_low) {
+			pg_block_free((pg_block_header_t*)list_remove_back(local_cache));
+		}
+	}
+	thread_busy_give(th);
 }
 
 // Given a pointer in a pg_block the function returns the pg_block_header
 // of this pg_block
-extern "C" pg_block_header_t *get_pg_block_header(void *ptr) {
-	return (*(pg_block_header_t **)get_address_pg(ptr));
+extern "C" pg_block_header_t *get_pg_block_header(void *ptr,
+	unsigned long pg_block_size) {
+	return (pg_block_header_t*)((unsigned long)ptr & ~(pg_block_size - 1));
 }
 
 // Given a pg_block_header the function allocates an object and returns it
 // If it fails, e.g. beacause the pg_block is full, it returns NULL
-extern "C" void *obj_alloc(pg_block_header_t *pg_block_header) {
+extern "C" void *obj_alloc(pg_block_header_t *pg_block_header,
+	int memory_class) {
 	void *obj;
-	int memory_class = get_memory_class(pg_block_header->object_size);
 	// Allocate an object
 	if (pg_block_header->freed_objects > 0) {
 		// Get object from the freed_LIFO
@@ -621,64 +2774,495 @@ extern "C" void *obj_alloc(pg_block_header_t *pg_block_header) {
 		}
 		pg_block_header->freed_objects--;
 	}
-	else if (pg_block_header->unallocated_objects > 0) {
-		// Get object from the unallocated objects
-		obj = pg_block_header->unallocated_ptr;
-		pg_block_header->unallocated_ptr = ((char*)pg_block_header->unallocated_ptr
-			+ pg_block_header->object_size);
+	else if (pg_block_header->unallocated_objects > 0) {
+		// Get object from the unallocated objects
+		obj = pg_block_header->unallocated_ptr;
+		pg_block_header->unallocated_ptr = ((char*)pg_block_header->unallocated_ptr
+			+ class_info[memory_class].memory_size);
+		if (pg_block_header->unallocated_ptr > pg_block_header->untouched_ptr) {
+			pg_block_header->untouched_ptr = pg_block_header->unallocated_ptr;
+		}
+		pg_block_header->unallocated_objects--;
+	}
+	else {
+		// There is no object to allocate, get_pg_block never returns a full one
+		return NULL;
+	}
+
+	th->stats.classes[memory_class].allocs++;
+	TRACE(TRACE_ALLOC, obj, memory_class, 0);
+
+	// If I just took the last object, try to get the remotely freed ones
+	if (pg_block_header->freed_objects == 0 &&
+		pg_block_header->unallocated_objects == 0) {
+		pg_block_collect_remote(pg_block_header);
+	}
+	heap_update(pg_block_header);
+	return obj;
+}
+
+// Frees an object of a pg_block owned by this thread
+extern "C" void obj_free(pg_block_header_t *pg_block_header, void *obj) {
+	int memory_class = pg_block_header->memory_class;
+
+	// Rearange freed_LIFO
+	if (memory_class == 0) {
+		// Special case if obj_size is 4 bytes, save pseudo_ptr
+		*(int*)obj = ptr_to_pseudo_ptr(pg_block_header->freed_LIFO);
+	}
+	else {
+		*(void**)obj = pg_block_header->freed_LIFO;
+	}
+	pg_block_header->freed_LIFO = obj;
+	pg_block_header->freed_objects++;
+
+	if (pg_block_is_empty(pg_block_header)) {
+		// If the pg_block is empty, free it
+		list_remove(pg_block_header->list, pg_block_header);
+		return_pg_block(pg_block_header);
+	}
+	else {
+		heap_update(pg_block_header);
+	}
+}
+
+// Publishes the chain of the slot to the remotely_freed_LIFO of its pg_block
+// with one cmp&swap
+// Returns 0 if the pg_block is orphaned, the chain stays in the slot
+extern "C" int remote_free_publish(remote_free_t *remote_free) {
+	pg_block_header_t *pg_block_header = remote_free->pg_block_header;
+	int memory_class = pg_block_header->memory_class;
+
+	void *old_ptr;
+	while (1) {
+		old_ptr = (void*)pg_block_header->remotely_freed_LIFO;
+		if (old_ptr == (void*)1) {
+			return 0;
+		}
+
+		// Link the chain in front of the remotely_freed_LIFO
+		if (memory_class == 0) {
+			*(int*)remote_free->tail = ptr_to_pseudo_ptr(remote_lifo_ptr(old_ptr));
+		}
+		else {
+			*(void**)remote_free->tail = remote_lifo_ptr(old_ptr);
+		}
+
+		if (compare_and_swap_ptr(&pg_block_header->remotely_freed_LIFO,
+			old_ptr, remote_lifo_pack(remote_free->head,
+			remote_lifo_count(old_ptr) + remote_free->objects)) != 0) {
+			TRACE(TRACE_REMOTE_FLUSH, pg_block_header, memory_class,
+				remote_free->objects);
+			remote_free->pg_block_header = NULL;
+			return 1;
+		}
+		stats_cas_retry(&pg_block_header->remotely_freed_LIFO);
+	}
+}
+
+// Publishes the chain of the slot, if the pg_block is orphaned it is adopted
+// instead
+extern "C" void remote_free_flush(remote_free_t *remote_free) {
+	pg_block_header_t *pg_block_header = remote_free->pg_block_header;
+	if (pg_block_header == NULL) {
+		return;
+	}
+	int memory_class = pg_block_header->memory_class;
+
+	while (!remote_free_publish(remote_free)) {
+		// Found orphaned block - Try to adopt it
+		// Check if someone else adopted it before me
+		if (compare_and_swap_ptr(&pg_block_header->remotely_freed_LIFO, (void*)1,
+			NULL) != 0) {
+			remote_free->pg_block_header = NULL;
+			pg_block_header->id = th->id;
+			th->stats.orphan_adoptions++;
+			TRACE(TRACE_ADOPT, pg_block_header, memory_class, 0);
+			pg_block_collect_remote(pg_block_header);
+			heap_update(pg_block_header);
+
+			// The chain is freed locally now, a failed cmp&swap may have linked
+			// its tail to objects that the owner collected since, so exactly
+			// its own objects are walked
+			void *obj = remote_free->head;
+			for (unsigned int i = 0; i < remote_free->objects; i++) {
+				void *next = (memory_class == 0) ? pseudo_ptr_to_ptr((int*)obj) :
+					*(void**)obj;
+				obj_free(pg_block_header, obj);
+				obj = next;
+			}
+			return;
+		}
+	}
+}
+
+extern "C" void remote_free_flush_all() {
+	for (int i = 0; i < REMOTE_FREE_SLOTS; i++) {
+		remote_free_flush(&th->remote_free[i]);
+	}
+	th->remote_free_ops = 0;
+}
+
+// Adds an object of a pg_block owned by another thread to the chain of its
+// pg_block, the chains live in a direct mapped table indexed by the pg_block
+// Until the chain is published the pg_block can't become empty, so it can't
+// be freed under us
+extern "C" void remote_free(pg_block_header_t *pg_block_header, void *obj) {
+	if (!thread_busy_take(th)) {
+		// The scavenger publishes the chains, the object is published alone
+		remote_free_t single = { pg_block_header, obj, obj, 1 };
+		remote_free_flush(&single);
+		return;
+	}
+
+	// pg_blocks are aligned to their size, so the low bits of the address
+	// are mostly zero, hash all of them
+	unsigned long hash = ((unsigned long)pg_block_header / MIN_PG_BLOCK_SIZE) *
+		0x9E3779B97F4A7C15UL;
+	remote_free_t *slot = &th->remote_free[hash >> 58];
+
+	if (slot->pg_block_header != pg_block_header) {
+		// Evict the chain of another pg_block
+		remote_free_flush(slot);
+		slot->pg_block_header = pg_block_header;
+		slot->head = NULL;
+		slot->tail = obj;
+		slot->objects = 0;
+	}
+
+	if (pg_block_header->memory_class == 0) {
+		*(int*)obj = ptr_to_pseudo_ptr(slot->head);
+	}
+	else {
+		*(void**)obj = slot->head;
+	}
+	slot->head = obj;
+	slot->objects++;
+
+	if (slot->objects >= REMOTE_FREE_BATCH) {
+		remote_free_flush(slot);
+	}
+	if (++th->remote_free_ops >= REMOTE_FREE_FLUSH) {
+		remote_free_flush_all();
+	}
+	thread_busy_give(th);
+}
+
+// Reads the configuration of the profiler from the environment
+extern "C" void prof_init() {
+	const char *rate = getenv("MEMORYLIB_PROF_RATE");
+	if (rate != NULL) {
+		prof.rate = strtoul(rate, NULL, 10);
+	}
+	const char *dump_signal = getenv("MEMORYLIB_PROF_SIGNAL");
+	if (dump_signal != NULL) {
+		struct sigaction action;
+		memset(&action, 0, sizeof(action));
+		action.sa_handler = prof_signal;
+		action.sa_flags = SA_RESTART;
+		sigemptyset(&action.sa_mask);
+		sem_init(&prof.dump_semaphore, 0, 0);
+		prof_dump_start();
+		pthread_atfork(NULL, NULL, prof_dump_start);
+		sigaction(atoi(dump_signal), &action, NULL);
+	}
+}
+
+// Bytes until the next sample, geometric with mean prof.rate
+extern "C" long prof_interval(unsigned long *random) {
+	if (prof.rate == 0) {
+		return PROF_OFF_INTERVAL;
+	}
+	// xorshift64, u is uniform in (0, 1]
+	*random ^= *random << 13;
+	*random ^= *random >> 7;
+	*random ^= *random << 17;
+	double u = ((*random >> 11) + 1) / 9007199254740992.0;
+	double interval = -log(u) * prof.rate;
+	return (interval < LONG_MAX / 2) ? (long)interval + 1 : LONG_MAX / 2;
+}
+
+// Dumps can't be written in a signal handler, sem_post is async signal safe
+extern "C" void prof_signal(int signal) {
+	sem_post(&prof.dump_semaphore);
+}
+
+// Writes a dump every time the signal comes, so it doesn't wait for an
+// allocation
+extern "C" void *prof_dump_thread(void *arg) {
+	while (1) {
+		if (sem_wait(&prof.dump_semaphore) == 0) {
+			prof_dump(NULL);
+		}
+	}
+	return NULL;
+}
+
+// Starts the thread that writes the dumps of the signal, and again in the
+// child of a fork
+extern "C" void prof_dump_start() {
+	pthread_t thread;
+	if (pthread_create(&thread, NULL, prof_dump_thread, NULL) == 0) {
+		pthread_detach(thread);
+	}
+}
+
+// Returns size bytes for the tables of the profiler, with prof.lock held
+// Returns NULL if there is no memory
+extern "C" void *prof_chunk_alloc(size_t size) {
+	if (prof.chunk_left < size) {
+		prof.chunk = (char*)memory_alloc(PROF_CHUNK);
+		if (prof.chunk == NULL) {
+			prof.chunk_left = 0;
+			return NULL;
+		}
+		prof.chunk_left = PROF_CHUNK;
+	}
+	void *mem = prof.chunk;
+	prof.chunk += size;
+	prof.chunk_left -= size;
+	return mem;
+}
+
+extern "C" unsigned long prof_ptr_hash(void *ptr) {
+	return ((unsigned long)ptr >> 4) * 0x9e3779b97f4a7c15UL >> 52;
+}
+
+// Records a sample of the object ptr of size bytes, allocated by the
+// calling thread, and starts the next interval
+extern "C" void prof_sample(void *ptr, size_t size) {
+	// The stack is taken without prof.lock, allocations of backtrace must not
+	// be sampled
+	th->prof_countdown = LONG_MAX;
+	if (ptr == NULL || prof.rate == 0) {
+		th->prof_countdown = prof_interval(&th->prof_random);
+		return;
+	}
+
+	// Skip the frames of memorylib, malloc of preload.c and operator new too
+	void *frames[PROF_SKIP + PROF_DEPTH];
+	int frames_num = backtrace(frames, PROF_SKIP + PROF_DEPTH);
+	Dl_info self, info;
+	int first = 1;
+	if (dladdr((void*)prof_sample, &self) != 0) {
+		while (first < frames_num && first < PROF_SKIP &&
+			dladdr(frames[first], &info) != 0 && info.dli_fbase == self.dli_fbase) {
+			first++;
+		}
+	}
+	int depth = frames_num - first;
+	if (depth > PROF_DEPTH) {
+		depth = PROF_DEPTH;
+	}
+	unsigned long hash = depth;
+	for (int i = 0; i < depth; i++) {
+		hash = (hash ^ (unsigned long)frames[first + i]) * 0x100000001b3UL;
+	}
+
+	pthread_mutex_lock(&prof.lock);
+	if (prof.buckets == NULL) {
+		prof.buckets = (prof_bucket_t**)memory_alloc(PROF_HASH *
+			sizeof(prof_bucket_t*));
+		prof.samples = (prof_sample_t**)memory_alloc(PROF_HASH *
+			sizeof(prof_sample_t*));
+		if (prof.buckets == NULL || prof.samples == NULL) {
+			handle_error("memory_alloc failed");
+		}
+	}
+
+	prof_bucket_t **chain = &prof.buckets[hash % PROF_HASH];
+	prof_bucket_t *bucket = *chain;
+	while (bucket != NULL && (bucket->hash != hash || bucket->depth != depth ||
+		memcmp(bucket->stack, &frames[first], depth * sizeof(void*)) != 0)) {
+		bucket = bucket->next;
+	}
+	int new_bucket = (bucket == NULL);
+	if (new_bucket) {
+		bucket = (prof_bucket_t*)prof_chunk_alloc(sizeof(prof_bucket_t));
+	}
+	prof_sample_t *sample = prof.free_samples;
+	if (sample != NULL) {
+		prof.free_samples = sample->next;
+	}
+	else if (bucket != NULL) {
+		sample = (prof_sample_t*)prof_chunk_alloc(sizeof(prof_sample_t));
+	}
+	if (bucket == NULL || sample == NULL) {
+		// No memory, the sample is lost
+		pthread_mutex_unlock(&prof.lock);
+		th->prof_countdown = prof_interval(&th->prof_random);
+		return;
+	}
+	if (new_bucket) {
+		// Chunks are zero
+		bucket->hash = hash;
+		bucket->depth = depth;
+		memcpy(bucket->stack, &frames[first], depth * sizeof(void*));
+		bucket->next = *chain;
+		*chain = bucket;
+	}
+	bucket->alloc_objects++;
+	bucket->alloc_bytes += size;
+	bucket->live_objects++;
+	bucket->live_bytes += size;
+
+	sample->ptr = ptr;
+	sample->size = size;
+	sample->bucket = bucket;
+	sample->next = prof.samples[prof_ptr_hash(ptr)];
+	prof.samples[prof_ptr_hash(ptr)] = sample;
+	prof.live_samples++;
+
+	// Tell the free path to look the object up
+	unsigned long entry = pg_map_get(ptr);
+	if ((entry & PG_MAP_TAG_MASK) == PG_MAP_LARGE) {
+		((large_span_t*)(entry & ~PG_MAP_TAG_MASK))->sampled = 1;
+	}
+	else {
+		get_pg_block_header(ptr, entry & ~PG_MAP_TAG_MASK)->sampled_objects++;
+	}
+	pthread_mutex_unlock(&prof.lock);
+
+	th->prof_countdown = prof_interval(&th->prof_random);
+}
+
+// Finds the sample of ptr and returns the link to it, with prof.lock held
+extern "C" prof_sample_t **prof_find(void *ptr) {
+	if (prof.samples == NULL) {
+		return NULL;
+	}
+	prof_sample_t **link = &prof.samples[prof_ptr_hash(ptr)];
+	while (*link != NULL && (*link)->ptr != ptr) {
+		link = &(*link)->next;
+	}
+	return (*link != NULL) ? link : NULL;
+}
+
+// Forgets the sample of ptr, before it is freed
+// It is called only if the pg_block or the large_span of ptr has samples
+extern "C" void prof_free(void *ptr) {
+	pthread_mutex_lock(&prof.lock);
+	prof_sample_t **link = prof_find(ptr);
+	if (link == NULL) {
+		pthread_mutex_unlock(&prof.lock);
+		return;
+	}
+	prof_sample_t *sample = *link;
+	*link = sample->next;
+	sample->bucket->live_objects--;
+	sample->bucket->live_bytes -= sample->size;
+	sample->next = prof.free_samples;
+	prof.free_samples = sample;
+	prof.live_samples--;
+
+	unsigned long entry = pg_map_get(ptr);
+	if ((entry & PG_MAP_TAG_MASK) == PG_MAP_LARGE) {
+		((large_span_t*)(entry & ~PG_MAP_TAG_MASK))->sampled = 0;
+	}
+	else {
+		get_pg_block_header(ptr, entry & ~PG_MAP_TAG_MASK)->sampled_objects--;
+	}
+	pthread_mutex_unlock(&prof.lock);
+}
+
+// Moves the sample of old_ptr, that my_realloc resized in place to new_ptr
+// of size bytes
+extern "C" void prof_realloc(void *old_ptr, void *new_ptr, size_t size) {
+	pthread_mutex_lock(&prof.lock);
+	prof_sample_t **link = prof_find(old_ptr);
+	if (link == NULL) {
+		pthread_mutex_unlock(&prof.lock);
+		return;
+	}
+	prof_sample_t *sample = *link;
+	sample->bucket->live_bytes += size - sample->size;
+	sample->size = size;
+	if (new_ptr != old_ptr) {
+		*link = sample->next;
+		sample->ptr = new_ptr;
+		sample->next = prof.samples[prof_ptr_hash(new_ptr)];
+		prof.samples[prof_ptr_hash(new_ptr)] = sample;
+	}
+	pthread_mutex_unlock(&prof.lock);
+}
+
+// Writes the profile to path, or to memorylib.<pid>.<n>.heap if it is NULL
+// The format is the heap profile of gperftools, that pprof reads:
+//   heap profile: <live objects>: <live bytes> [<objects>: <bytes>] @ heap_v2/<rate>
+//   <live objects>: <live bytes> [<objects>: <bytes>] @ <stack>
+//   ...
+//   MAPPED_LIBRARIES:
+//   <the contents of /proc/self/maps>
+// The counts are of the samples, pprof scales them by the rate
+// Returns 0 or the errno of the failure
+extern "C" int prof_dump(const char *path) {
+	char default_path[4096];
+	pthread_mutex_lock(&prof.lock);
+	if (path == NULL) {
+		const char *dir = getenv("MEMORYLIB_PROF_DIR");
+		snprintf(default_path, sizeof(default_path), "%s/memorylib.%d.%lu.heap",
+			dir != NULL ? dir : ".", getpid(), prof.dumps++);
+		path = default_path;
+	}
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd == -1) {
+		pthread_mutex_unlock(&prof.lock);
+		return errno;
+	}
 
-		// Check if unallocated_ptr is the address of a pointer to pg_block_header
-		void *pg = get_address_pg(pg_block_header->unallocated_ptr);
-		if (pg == pg_block_header->unallocated_ptr) {
-			// Skip wasted_objects_ptr_per_pg objects
-			pg_block_header->unallocated_ptr =
-				((char*)pg_block_header->unallocated_ptr + (pg_block_header->object_size
-				* class_info[memory_class].wasted_obj_ptr_per_pg));
+	size_t total[4] = { 0, 0, 0, 0 };
+	for (int i = 0; prof.buckets != NULL && i < PROF_HASH; i++) {
+		for (prof_bucket_t *bucket = prof.buckets[i]; bucket != NULL;
+			bucket = bucket->next) {
+			total[0] += bucket->live_objects;
+			total[1] += bucket->live_bytes;
+			total[2] += bucket->alloc_objects;
+			total[3] += bucket->alloc_bytes;
 		}
-		pg_block_header->unallocated_objects--;
 	}
-	else if (pg_block_header->remotely_freed_LIFO != NULL) {
-		// Get the lifo from the remotely_freed_LIFO
-		void *lifo = atomic_empty_lifo(&pg_block_header->remotely_freed_LIFO);
 
-		// Get object from the lifo
-		obj = lifo;
-		// Save lifo to freed_LIFO
-		if (memory_class == 0) {
-			// Special case if obj_size is 4 bytes
-			pg_block_header->freed_LIFO = pseudo_ptr_to_ptr((int*)obj);
-			// Count the free_objects
-			pg_block_header->freed_objects = pseudo_lifo_size(pg_block_header->freed_LIFO);
-		}
-		else {
-			pg_block_header->freed_LIFO = *(void**)obj;
-			// Count the free_objects
-			pg_block_header->freed_objects = lifo_size(pg_block_header->freed_LIFO);
+	char line[64 + PROF_DEPTH * 20];
+	int ok = 1;
+	int length = snprintf(line, sizeof(line),
+		"heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", total[0], total[1],
+		total[2], total[3], prof.rate);
+	ok = write(fd, line, length) == length;
+	for (int i = 0; ok && prof.buckets != NULL && i < PROF_HASH; i++) {
+		for (prof_bucket_t *bucket = prof.buckets[i]; ok && bucket != NULL;
+			bucket = bucket->next) {
+			length = snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @",
+				bucket->live_objects, bucket->live_bytes, bucket->alloc_objects,
+				bucket->alloc_bytes);
+			for (int j = 0; j < bucket->depth; j++) {
+				length += snprintf(line + length, sizeof(line) - length, " %p",
+					bucket->stack[j]);
+			}
+			line[length++] = '\n';
+			ok = write(fd, line, length) == length;
 		}
-
-	}
-	else {
-		// There is no object to allocate, Don't know if this ever happens
 	}
-
-	// If I just took the last object, move pg_block at the end of the list
-	if (pg_block_is_full(pg_block_header) &&
-		list_get_back(&th->heap[memory_class]) != pg_block_header) {
-		list_remove(&th->heap[memory_class], pg_block_header);
-		list_insert_back(&th->heap[memory_class],	pg_block_header);
+	pthread_mutex_unlock(&prof.lock);
+
+	// pprof finds the symbols with the mappings
+	const char *mapped = "\nMAPPED_LIBRARIES:\n";
+	ok = ok && write(fd, mapped, strlen(mapped)) == (ssize_t)strlen(mapped);
+	int maps = open("/proc/self/maps", O_RDONLY);
+	if (maps != -1) {
+		char buffer[4096];
+		ssize_t bytes;
+		while (ok && (bytes = read(maps, buffer, sizeof(buffer))) > 0) {
+			ok = write(fd, buffer, bytes) == bytes;
 		}
-	return obj;
+		close(maps);
+	}
+	int error = ok ? 0 : (errno != 0 ? errno : EIO);
+	close(fd);
+	return error;
 }
 
 extern "C" void *my_malloc(size_t size) {
-	// We define a thread_local variable, that will be per-thread.
-	// We also make it static, in order to persist for the lifetime of the thread.
-	// When the variable comes to life, the constructor is executed (thread).
-	// When the variable comes out of scope, at the end of the life of the thread,
-	// given that it is static, the destructor is executed (~thread).
-	if (th == NULL) {
-		thread_local static thread_t my_th;
-		th = &my_th;
+	if (th == NULL && !thread_attach()) {
+		return bootstrap_alloc(size, BOOTSTRAP_HEADER_SIZE);
 	}
 
 	// Check input
@@ -687,240 +3271,732 @@ extern "C" void *my_malloc(size_t size) {
 		return NULL;
 	}
 	else if (size > MAX_SIZE_SMALL_OBJ) {
-		// I'll return a 16B alligned memory
-		void *obj = memory_alloc(size+16);
-		*(size_t*)obj = size;
-		obj = (void*)((unsigned long)obj + 16);
-
-		void *ptr = atomic_pop(&large_obj_table.freed_LIFO);
-		if (ptr != NULL) {
-			// Get obj from freed_LIFO
-			*(void**)ptr = obj;
+		if (size > MAX_SIZE_LARGE_OBJ) {
+			return NULL;
 		}
-		else {
-			// Get obj from unallocated
-			void *old_ptr, *new_ptr;
-			do {
-				old_ptr = (void*)large_obj_table.unallocated_ptr;
-
-				if (old_ptr > (void*)((long)large_obj_table.array +
-					LARGE_OBJ_TABLE_SIZE)) {
-					printf("Run out of memory\n");
-					exit(1);
-				}
-				new_ptr = (void*)((long)large_obj_table.unallocated_ptr + 8);
-			} while(compare_and_swap_ptr(&large_obj_table.unallocated_ptr, old_ptr, new_ptr) == 0);
-			*(void**)old_ptr = obj;
+		// I'll return a 16B alligned memory
+		size_t number_of_pages = (size + LARGE_OBJ_HEADER_SIZE + pg_size - 1) /
+			pg_size;
+		large_span_t *span = large_span_alloc(number_of_pages);
+		if (span == NULL) {
+			return NULL;
 		}
-		return obj;
+		span->sampled = 0;
+		atmc_add32(&large_objects, 1);
+		th->stats.large_allocs++;
+		th->stats.large_pages += number_of_pages;
+		TRACE(TRACE_LARGE_ALLOC, (char*)span + LARGE_OBJ_HEADER_SIZE,
+			TRACE_NO_CLASS, number_of_pages);
+		PROF_MALLOC((char*)span + LARGE_OBJ_HEADER_SIZE, size);
+		return (char*)span + LARGE_OBJ_HEADER_SIZE;
 	}
 
 	int memory_class = get_memory_class(size);
 
 	// Get a pg_block
 	pg_block_header_t *pg_block_header = get_pg_block(memory_class);
+	if (pg_block_header == NULL) {
+		return NULL;
+	}
 	// Get an object
-	void *obj = obj_alloc(pg_block_header);
-
-	#ifdef MEMORYLIB_DEBUG
-		printf("EVENT, my_malloc: alocated %p\n", obj);
-		print_less_heap();
-		//print_heap();
-	#endif
+	void *obj = obj_alloc(pg_block_header, memory_class);
+	PROF_MALLOC(obj, size);
 	return obj;
 }
 
-extern "C" void my_free(void *ptr) {
-	if (th == NULL) {
-		thread_local static thread_t my_th;
-		th = &my_th;
+// Frees an object while the heaps of this thread can't be used
+// Small objects go straight to the remotely_freed_LIFO of their pg_block,
+// objects of orphaned pg_blocks and of the bootstrap arena are leaked
+extern "C" void detached_free(void *ptr) {
+	unsigned long entry = pg_map_get(ptr);
+	if ((entry & PG_MAP_TAG_MASK) == PG_MAP_LARGE) {
+		large_span_t *span = (large_span_t*)(entry & ~PG_MAP_TAG_MASK);
+		atmc_add32(&large_objects, -1);
+		pthread_mutex_lock(&stats_registry.lock);
+		stats_registry.retired.large_frees++;
+		stats_registry.retired.large_pages -= span->number_of_pages;
+		pthread_mutex_unlock(&stats_registry.lock);
+		if (span->sampled) {
+			prof_free(ptr);
+		}
+		large_span_free(span);
+		return;
+	}
+	else if ((entry & PG_MAP_TAG_MASK) != PG_MAP_SMALL) {
+		return;
 	}
 
-
-	for (void *tmp = large_obj_table.array; tmp < large_obj_table.unallocated_ptr;
-		tmp = (void*)((long)tmp + 8)) {
-		if (*(void**)tmp == ptr) {
-			ptr = (void*)((long)ptr - 16);
-			memory_dealloc(ptr, *(size_t*)ptr);
-			*(void**)tmp = NULL;
-			atomic_push(&large_obj_table.freed_LIFO, tmp);
+	pg_block_header_t *pg_block_header = get_pg_block_header(ptr,
+		entry & ~PG_MAP_TAG_MASK);
+	if (pg_block_header->sampled_objects != 0) {
+		prof_free(ptr);
+	}
+	void *old_ptr;
+	do {
+		old_ptr = (void*)pg_block_header->remotely_freed_LIFO;
+		if (old_ptr == (void*)1) {
+			// Orphaned, only a thread with a heap can adopt it
 			return;
 		}
+		if (pg_block_header->memory_class == 0) {
+			*(int*)ptr = ptr_to_pseudo_ptr(remote_lifo_ptr(old_ptr));
+		}
+		else {
+			*(void**)ptr = remote_lifo_ptr(old_ptr);
+		}
+	} while (compare_and_swap_ptr(&pg_block_header->remotely_freed_LIFO, old_ptr,
+		remote_lifo_pack(ptr, remote_lifo_count(old_ptr) + 1)) == 0);
+
+	pthread_mutex_lock(&stats_registry.lock);
+	stats_registry.retired.classes[pg_block_header->memory_class].frees++;
+	stats_registry.retired.remote_frees++;
+	pthread_mutex_unlock(&stats_registry.lock);
+}
+
+extern "C" void my_free(void *ptr) {
+	if (ptr == NULL) {
+		return;
+	}
+	if (th == NULL && !thread_attach()) {
+		detached_free(ptr);
+		return;
+	}
+
+	unsigned long entry = pg_map_get(ptr);
+	if ((entry & PG_MAP_TAG_MASK) == PG_MAP_LARGE) {
+		large_span_t *span = (large_span_t*)(entry & ~PG_MAP_TAG_MASK);
+		atmc_add32(&large_objects, -1);
+		th->stats.large_frees++;
+		th->stats.large_pages -= span->number_of_pages;
+		TRACE(TRACE_LARGE_FREE, ptr, TRACE_NO_CLASS, span->number_of_pages);
+		if (span->sampled) {
+			prof_free(ptr);
+		}
+		large_span_free(span);
+		return;
+	}
+	else if ((entry & PG_MAP_TAG_MASK) != PG_MAP_SMALL) {
+		// Not allocated by us
+		#ifdef MEMORYLIB_DEBUG
+		printf("my_free: %p is not allocated by memorylib\n", ptr);
+		#endif
+		return;
 	}
 
 	// Then it is a small obj
-	pg_block_header_t *pg_block_header = get_pg_block_header(ptr);
-	int memory_class = get_memory_class(pg_block_header->object_size);
+	pg_block_header_t *pg_block_header = get_pg_block_header(ptr,
+		entry & ~PG_MAP_TAG_MASK);
+	th->stats.classes[pg_block_header->memory_class].frees++;
+	if (pg_block_header->sampled_objects != 0) {
+		prof_free(ptr);
+	}
 
-	// Rearange remotely_freed_LIFO
 	if (pg_block_header->id != th->id) {
-		void *old_ptr;
-		while (1) {
-			old_ptr = (void*)pg_block_header->remotely_freed_LIFO;
-			if (memory_class == 0) {
-				*(int*)ptr = ptr_to_pseudo_ptr(old_ptr);
-			}
-			else {
-				*(void**)ptr = old_ptr;
-			}
+		th->stats.remote_frees++;
+		TRACE(TRACE_REMOTE_FREE, ptr, pg_block_header->memory_class, 0);
+		remote_free(pg_block_header, ptr);
+		return;
+	}
 
-			if (old_ptr == (void*)1) {
-				// Found orphaned block - Try to adopt it
-				// change id, insert to list free ptr
-				// Check if someone else adopted it before me
-				if (compare_and_swap_ptr(&pg_block_header->remotely_freed_LIFO, old_ptr,
-					 NULL) != 0) {
-					 pg_block_header->id = th->id;
-					 list_insert_front(&th->heap[memory_class], pg_block_header);
-					 //print_heap();
-				}
-				my_free(ptr);
-				return;
-			}
+	TRACE(TRACE_FREE, ptr, pg_block_header->memory_class, 0);
+	obj_free(pg_block_header, ptr);
+}
 
-			if (compare_and_swap_ptr(&pg_block_header->remotely_freed_LIFO,
-				old_ptr, ptr) == 0) {
-					#ifdef MEMORYLIB_DEBUG
-					printf("my_free: cmp&swap failed, retry\n");
-					#endif
-				}
-				else {
-					break;
-				}
-		}
+// Frees an object whose size is known, the pg_block or span comes from the
+// size and the pg_map isn't read
+// size must be the size it was allocated or last reallocated with, objects
+// of my_aligned_alloc must be freed with my_free
+extern "C" void my_free_sized(void *ptr, size_t size) {
+	if (ptr == NULL) {
+		return;
+	}
+	if (th == NULL && !thread_attach()) {
+		detached_free(ptr);
+		return;
+	}
+
+	// Memory of the bootstrap arena is never freed, the pg_map is only read
+	// for chunks out of its reserved range
+	if (((char*)ptr >= bootstrap.start && (char*)ptr < bootstrap.limit) ||
+		(bootstrap.outside &&
+		(pg_map_get(ptr) & PG_MAP_TAG_MASK) == PG_MAP_BOOTSTRAP)) {
+		return;
+	}
+
+	#ifdef MEMORYLIB_CHECK_SIZED
+	unsigned long entry = pg_map_get(ptr);
+	int wrong_size;
+	if (size <= MAX_SIZE_SMALL_OBJ) {
+		// my_realloc may have kept the object in a bigger memory_class
+		unsigned int memory_class = get_memory_class(size);
+		wrong_size = (entry & PG_MAP_TAG_MASK) != PG_MAP_SMALL ||
+			class_info[memory_class].pg_block_size != (entry & ~PG_MAP_TAG_MASK) ||
+			get_pg_block_header(ptr, entry & ~PG_MAP_TAG_MASK)->memory_class <
+			memory_class;
+	}
+	else {
+		large_span_t *span = (large_span_t*)(entry & ~PG_MAP_TAG_MASK);
+		wrong_size = (entry & PG_MAP_TAG_MASK) != PG_MAP_LARGE ||
+			(char*)span + LARGE_OBJ_HEADER_SIZE != ptr ||
+			(size_t)((char*)large_span_end(span) - (char*)ptr) < size;
+	}
+	if (wrong_size) {
 		#ifdef MEMORYLIB_DEBUG
-		printf("EVENT, my_free: remote free %p\n", ptr);
+		printf("my_free_sized: %p wasn't allocated with size %zu\n", ptr, size);
 		#endif
+		my_free(ptr);
+		return;
+	}
+	#endif
 
+	if (size > MAX_SIZE_SMALL_OBJ) {
+		large_span_t *span = (large_span_t*)((char*)ptr - LARGE_OBJ_HEADER_SIZE);
+		atmc_add32(&large_objects, -1);
+		th->stats.large_frees++;
+		th->stats.large_pages -= span->number_of_pages;
+		TRACE(TRACE_LARGE_FREE, ptr, TRACE_NO_CLASS, span->number_of_pages);
+		if (span->sampled) {
+			prof_free(ptr);
+		}
+		large_span_free(span);
 		return;
 	}
 
-	// Rearange freed_LIFO
-	if (memory_class == 0) {
-		// Special case if obj_size is 4 bytes, save pseudo_ptr
-		*(int*)ptr = ptr_to_pseudo_ptr(pg_block_header->freed_LIFO);
+	pg_block_header_t *pg_block_header = get_pg_block_header(ptr,
+		class_info[get_memory_class(size)].pg_block_size);
+	th->stats.classes[pg_block_header->memory_class].frees++;
+	if (pg_block_header->sampled_objects != 0) {
+		prof_free(ptr);
 	}
-	else {
-		*(void**)ptr = pg_block_header->freed_LIFO;
+	if (pg_block_header->id != th->id) {
+		th->stats.remote_frees++;
+		TRACE(TRACE_REMOTE_FREE, ptr, pg_block_header->memory_class, 0);
+		remote_free(pg_block_header, ptr);
+		return;
 	}
-	pg_block_header->freed_LIFO = ptr;
-	pg_block_header->freed_objects++;
+	TRACE(TRACE_FREE, ptr, pg_block_header->memory_class, 0);
+	obj_free(pg_block_header, ptr);
+}
 
-	#ifdef MEMORYLIB_DEBUG
-		printf("EVENT, my_free: free %p\n", ptr);
-		print_less_heap();
-		//print_heap();
-	#endif
+// Allocates nmemb objects of size bytes, all zero
+// Objects that are new, from never used bump space of a pg_block or from a
+// new mapping, aren't cleared
+extern "C" void *my_calloc(size_t nmemb, size_t size) {
+	if (size != 0 && nmemb > MAX_SIZE_LARGE_OBJ / size) {
+		return NULL;
+	}
+	size *= nmemb;
+	if (th == NULL && !thread_attach()) {
+		// The bootstrap arena is never reused
+		return bootstrap_alloc(size, BOOTSTRAP_HEADER_SIZE);
+	}
 
-	if (pg_block_is_empty(pg_block_header)) {
-		// If the pg_block is empty, free it
-		list_remove(&th->heap[memory_class], pg_block_header);
-		return_pg_block(pg_block_header);
+	// Check input
+	if (size <= 0) {
+		printf("my_calloc: Wrong size\n");
+		return NULL;
+	}
+	else if (size > MAX_SIZE_SMALL_OBJ) {
+		size_t number_of_pages = (size + LARGE_OBJ_HEADER_SIZE + pg_size - 1) /
+			pg_size;
+		if (number_of_pages <= LARGE_CALLOC_MAP_PAGES) {
+			void *obj = my_malloc(size);
+			if (obj != NULL) {
+				memset(obj, 0, size);
+			}
+			return obj;
+		}
+		large_span_t *span = large_span_map(number_of_pages);
+		if (span == NULL) {
+			return NULL;
+		}
+		atmc_add32(&large_objects, 1);
+		th->stats.large_allocs++;
+		th->stats.large_pages += number_of_pages;
+		TRACE(TRACE_LARGE_ALLOC, (char*)span + LARGE_OBJ_HEADER_SIZE,
+			TRACE_NO_CLASS, number_of_pages);
+		PROF_MALLOC((char*)span + LARGE_OBJ_HEADER_SIZE, size);
+		return (char*)span + LARGE_OBJ_HEADER_SIZE;
+	}
+
+	int memory_class = get_memory_class(size);
+	pg_block_header_t *pg_block_header = get_pg_block(memory_class);
+	if (pg_block_header == NULL) {
+		return NULL;
 	}
-	else if (list_get_front(&th->heap[memory_class]) != pg_block_header) {
-		// Move the pg_block to the beginning of the list
-		list_remove(&th->heap[memory_class], pg_block_header);
-		list_insert_front(&th->heap[memory_class], pg_block_header);
+	void *untouched_ptr = pg_block_header->untouched_ptr;
+	void *obj = obj_alloc(pg_block_header, memory_class);
+	if (obj < untouched_ptr) {
+		memset(obj, 0, size);
+	}
+	PROF_MALLOC(obj, size);
+	return obj;
+}
+
+// Returns the number of bytes that can be used in the object of ptr
+extern "C" size_t my_malloc_usable_size(void *ptr) {
+	if (ptr == NULL) {
+		return 0;
+	}
+
+	unsigned long entry = pg_map_get(ptr);
+	switch (entry & PG_MAP_TAG_MASK) {
+		case PG_MAP_SMALL:
+			return class_info[get_pg_block_header(ptr, entry & ~PG_MAP_TAG_MASK)->
+				memory_class].memory_size;
+		case PG_MAP_LARGE:
+			return (char*)large_span_end((large_span_t*)(entry & ~PG_MAP_TAG_MASK)) -
+				(char*)ptr;
+		case PG_MAP_BOOTSTRAP:
+			return *(size_t*)((char*)ptr - BOOTSTRAP_HEADER_SIZE);
+		default:
+			return 0;
 	}
 }
 
 extern "C" void *my_realloc(void *ptr, size_t size) {
-	if (th == NULL) {
-		thread_local static thread_t my_th;
-		th = &my_th;
+	if (ptr == NULL) {
+		return my_malloc(size);
 	}
 
 	// Check input
 	if (size <= 0) {
-		printf("my_malloc: Wrong size\n");
+		printf("my_realloc: Wrong size\n");
 		return NULL;
 	}
-	else if (size > MAX_SIZE_SMALL_OBJ) {
-		// TODO: big object
-		printf("my_malloc: Big object, not supported yet\n");
+	else if (size > MAX_SIZE_LARGE_OBJ) {
 		return NULL;
 	}
 
-	int new_memory_class = get_memory_class(size);
-	pg_block_header_t *pg_block_header = get_pg_block_header(ptr);
-	int old_memory_class = get_memory_class(pg_block_header->object_size);
+	unsigned long entry = pg_map_get(ptr);
+	size_t usable_size = my_malloc_usable_size(ptr);
+	if (usable_size == 0) {
+		#ifdef MEMORYLIB_DEBUG
+		printf("my_realloc: %p is not allocated by memorylib\n", ptr);
+		#endif
+		return NULL;
+	}
 
-	if (new_memory_class <= old_memory_class) {
+	if ((entry & PG_MAP_TAG_MASK) == PG_MAP_SMALL) {
+		// Small objects keep their memory_class if they don't grow out of it,
+		// or if they don't shrink to half of it
+		// my_free_sized finds the pg_block from the size, it must not change
+		if (size <= MAX_SIZE_SMALL_OBJ) {
+			unsigned int memory_class = get_memory_class(size);
+			pg_block_header_t *pg_block_header = get_pg_block_header(ptr,
+				entry & ~PG_MAP_TAG_MASK);
+			if (memory_class <= pg_block_header->memory_class &&
+				2 * class_info[memory_class].memory_size > usable_size &&
+				class_info[memory_class].pg_block_size ==
+				class_info[pg_block_header->memory_class].pg_block_size) {
+				if (pg_block_header->sampled_objects != 0) {
+					prof_realloc(ptr, ptr, size);
+				}
+				return ptr;
+			}
+		}
+	}
+	else if ((entry & PG_MAP_TAG_MASK) == PG_MAP_LARGE &&
+		size > MAX_SIZE_SMALL_OBJ) {
+		// Large objects are resized in place, but like small objects they only
+		// shrink to half of their span or less
+		// Aligned objects that don't start at the usual offset keep the old way
+		large_span_t *span = (large_span_t*)(entry & ~PG_MAP_TAG_MASK);
+		size_t number_of_pages = (size + LARGE_OBJ_HEADER_SIZE + pg_size - 1) /
+			pg_size;
+		int shrink = 2 * number_of_pages <= span->number_of_pages;
+		if (ptr == (char*)span + LARGE_OBJ_HEADER_SIZE &&
+			(size > usable_size || shrink)) {
+			size_t old_pages = span->number_of_pages;
+			large_span_t *resized = large_span_resize(span, number_of_pages);
+			if (resized != NULL) {
+				if (th != NULL) {
+					th->stats.large_pages += number_of_pages - old_pages;
+				}
+				else {
+					pthread_mutex_lock(&stats_registry.lock);
+					stats_registry.retired.large_pages += number_of_pages - old_pages;
+					pthread_mutex_unlock(&stats_registry.lock);
+				}
+				if (resized->sampled) {
+					prof_realloc(ptr, (char*)resized + LARGE_OBJ_HEADER_SIZE, size);
+				}
+				return (char*)resized + LARGE_OBJ_HEADER_SIZE;
+			}
+		}
+		// A span that can't shrink in place, because it crosses
+		// LARGE_SPAN_MAX_PAGES, is copied
+		if (size <= usable_size && (!shrink ||
+			ptr != (char*)span + LARGE_OBJ_HEADER_SIZE)) {
+			return ptr;
+		}
+	}
+	else if ((entry & PG_MAP_TAG_MASK) != PG_MAP_LARGE && size <= usable_size) {
 		return ptr;
 	}
 
+	// Move it, large objects that shrink enough become small ones
 	void *obj = my_malloc(size);
-	memcpy(obj, ptr, pg_block_header->object_size);
+	if (obj == NULL) {
+		return NULL;
+	}
+	memcpy(obj, ptr, (size < usable_size) ? size : usable_size);
 	my_free(ptr);
 
 	return obj;
 }
 
-// With the following we can define functions to be called when we enter the
-// library for the first time and when we exit the library.
-__attribute__((constructor)) static void initializer(void) {
-	#ifdef MEMORYLIB_DEBUG
-	printf("!!! Library loaded !!!\n");
-	#endif
-	pg_size = getpagesize();
+// Allocates size bytes aligned to allignment, which is a power of two
+// Small objects come from the first memory_class that is naturally aligned
+// to allignment, large objects start allignment bytes in their span, or
+// right after the first page of a span carved so that it is aligned
+extern "C" void *my_aligned_alloc(size_t allignment, size_t size) {
+	if (size > MAX_SIZE_LARGE_OBJ || allignment > MAX_SIZE_LARGE_OBJ) {
+		return NULL;
+	}
+	if (th == NULL && !thread_attach()) {
+		return bootstrap_alloc(size, allignment);
+	}
+	if (size == 0) {
+		size = 1;
+	}
 
-	/*---------- Initialize class_info ----------*/
-	int memory_size = 2;
-	for (int i = 0; i < CLASSES; i++) {
+	if (size <= MAX_SIZE_SMALL_OBJ && allignment <= MAX_SIZE_SMALL_OBJ) {
+		int memory_class = get_memory_class(size);
+		while (class_info[memory_class].allignment < allignment) {
+			memory_class++;
+		}
+		pg_block_header_t *pg_block_header = get_pg_block(memory_class);
+		if (pg_block_header == NULL) {
+			return NULL;
+		}
+		void *obj = obj_alloc(pg_block_header, memory_class);
+		PROF_MALLOC(obj, size);
+		return obj;
+	}
 
-		/*---------- Initialize memory_size ----------*/
-		class_info[i].memory_size = memory_size = memory_size<<1;
+	char *obj;
+	large_span_t *span;
+	if (allignment <= LARGE_OBJ_HEADER_SIZE) {
+		return my_malloc(size);
+	}
+	else if (allignment <= (size_t)pg_size) {
+		size_t number_of_pages = (allignment + size + pg_size - 1) / pg_size;
+		span = large_span_alloc(number_of_pages);
+		if (span == NULL) {
+			return NULL;
+		}
+		obj = (char*)span + allignment;
+	}
+	else {
+		size_t number_of_pages = (pg_size + size + pg_size - 1) / pg_size;
+		span = large_span_alloc_aligned(number_of_pages, allignment);
+		if (span == NULL) {
+			return NULL;
+		}
+		obj = (char*)span + pg_size;
+	}
+	span->sampled = 0;
+	atmc_add32(&large_objects, 1);
+	th->stats.large_allocs++;
+	th->stats.large_pages += span->number_of_pages;
+	TRACE(TRACE_LARGE_ALLOC, obj, TRACE_NO_CLASS, span->number_of_pages);
+
+	unsigned long entry = pg_map_get(obj - LARGE_OBJ_HEADER_SIZE);
+	if (pg_map_get(obj) != entry) {
+		// The object starts on the second page, map it for my_free
+		pg_map_set(obj, 1, entry);
+	}
+	PROF_MALLOC(obj, size);
+	return obj;
+}
 
-		/*---------- Initialize pg_block_size and obj_in_pg_block ----------*/
-		// Initial estimation
-		class_info[i].pg_block_size = OBJ_IN_PG_BLOCK_HINT *
-			class_info[i].memory_size;
+// No thread may be in the registry in a fork, the scavenger holds it while
+// it takes local_caches
+extern "C" void stats_fork_prepare() {
+	pthread_mutex_lock(&stats_registry.lock);
+}
 
-		// Normalize pg_block_size between MIN_PG_BLOCK_SIZE and MAX_PG_BLOCK_SIZE
-		if (class_info[i].pg_block_size < MIN_PG_BLOCK_SIZE) {
-			class_info[i].pg_block_size = MIN_PG_BLOCK_SIZE;
+extern "C" void stats_fork_parent() {
+	pthread_mutex_unlock(&stats_registry.lock);
+}
+
+// Only the thread that forked runs in the child, the others are retired, the
+// stacks that hold their thread_t are reused by the next threads
+extern "C" void stats_fork_child() {
+	stats_node_t *self = (th_state == TH_READY) ? &th->stats_node : NULL;
+	while (stats_registry.threads.size > (self != NULL ? 1 : 0)) {
+		stats_node_t *node = (stats_node_t*)list_get_front(&stats_registry.threads);
+		if (node == self) {
+			node = (stats_node_t*)list_get_next(node);
+		}
+		list_remove(&stats_registry.threads, node);
+		stats_add(&stats_registry.retired, node->stats);
+	}
+	pthread_mutex_unlock(&stats_registry.lock);
+}
+
+// Sums the counters of every thread, running or finished
+extern "C" void stats_merge(stats_t *total) {
+	pthread_mutex_lock(&stats_registry.lock);
+	*total = stats_registry.retired;
+	void *node = list_get_front(&stats_registry.threads);
+	for (int i = 0; i < stats_registry.threads.size; i++) {
+		stats_add(total, ((stats_node_t*)node)->stats);
+		node = list_get_next(node);
+	}
+	pthread_mutex_unlock(&stats_registry.lock);
+}
+
+// Counters that my_mallctl reads straight from the merged stats
+struct stats_name {
+	const char *name;
+	size_t offset;
+};
+static const struct stats_name stats_names[] = {
+	{ "stats.remote_frees", offsetof(stats_t, remote_frees) },
+	{ "stats.orphan_adoptions", offsetof(stats_t, orphan_adoptions) },
+	{ "stats.local_cache.hits", offsetof(stats_t, local_cache_hits) },
+	{ "stats.local_cache.misses", offsetof(stats_t, local_cache_misses) },
+	{ "stats.global_cache.hits", offsetof(stats_t, global_cache_hits) },
+	{ "stats.global_cache.misses", offsetof(stats_t, global_cache_misses) },
+	{ "stats.large.allocs", offsetof(stats_t, large_allocs) },
+	{ "stats.large.frees", offsetof(stats_t, large_frees) },
+	{ "stats.cas_retries", offsetof(stats_t, cas_retries) },
+};
+
+// Reads the value of a stats name of the merged stats, returns 0 if there is
+// no such name
+extern "C" int stats_read(const char *name, stats_t *stats, size_t *value) {
+	for (size_t i = 0; i < sizeof(stats_names) / sizeof(stats_names[0]); i++) {
+		if (strcmp(name, stats_names[i].name) == 0) {
+			*value = *(size_t*)((char*)stats + stats_names[i].offset);
+			return 1;
 		}
-		else if (class_info[i].pg_block_size > MAX_PG_BLOCK_SIZE) {
-			class_info[i].pg_block_size = MAX_PG_BLOCK_SIZE;
+	}
+
+	if (strcmp(name, "stats.allocated") == 0) {
+		*value = stats->large_pages * pg_size;
+		for (int i = 0; i < CLASSES; i++) {
+			*value += (stats->classes[i].allocs - stats->classes[i].frees) *
+				class_info[i].memory_size;
 		}
-		class_info[i].number_of_pages = class_info[i].pg_block_size / pg_size;
-		class_info[i].obj_in_pg_block = class_info[i].pg_block_size /
-			class_info[i].memory_size;
+		return 1;
+	}
+	if (strcmp(name, "stats.large.allocated") == 0) {
+		*value = stats->large_pages * pg_size;
+		return 1;
+	}
 
-		// Measure the waste for the pg_block_header
-		class_info[i].wasted_obj_pg_header = PG_BLOCK_HEADER_SIZE /
-			class_info[i].memory_size;
-		if (class_info[i].wasted_obj_pg_header == 0) {
-			class_info[i].wasted_obj_pg_header = 1;
+	// stats.class.<memory_class>.<counter>
+	const char *prefix = "stats.class.";
+	if (strncmp(name, prefix, strlen(prefix)) != 0) {
+		return 0;
+	}
+	char *end;
+	unsigned long memory_class = strtoul(name + strlen(prefix), &end, 10);
+	if (end == name + strlen(prefix) || memory_class >= CLASSES) {
+		return 0;
+	}
+	class_stats_t *class_stats = &stats->classes[memory_class];
+	if (strcmp(end, ".size") == 0) {
+		*value = class_info[memory_class].memory_size;
+	}
+	else if (strcmp(end, ".allocs") == 0) {
+		*value = class_stats->allocs;
+	}
+	else if (strcmp(end, ".frees") == 0) {
+		*value = class_stats->frees;
+	}
+	else if (strcmp(end, ".allocated") == 0) {
+		*value = (class_stats->allocs - class_stats->frees) *
+			class_info[memory_class].memory_size;
+	}
+	else {
+		return 0;
+	}
+	return 1;
+}
+
+// Reads a counter or runs a command by its name, like mallctl of jemalloc
+// Counters are size_t, they are copied to oldp and *oldlenp must be
+// sizeof(size_t). Commands take no arguments.
+// Counters of the threads, summed over all of them:
+//   stats.allocated                  bytes in objects, by their memory_size
+//   stats.class.<i>.{size,allocs,frees,allocated}   per memory_class
+//   stats.large.{allocs,frees,allocated}
+//   stats.remote_frees, stats.orphan_adoptions, stats.cas_retries
+//   stats.{local_cache,global_cache}.{hits,misses}   pg_blocks taken
+// Counters of the process:
+//   stats.mapped                     bytes mapped from the OS
+//   stats.{mmaps,munmaps,mremaps}
+//   stats.purges                     madvise calls that gave pages back
+//   stats.superblocks                superblocks of pg_blocks mapped
+//   stats.superblocks_retained       free superblocks kept mapped, purged
+//   stats.dirty                      bytes of free units of superblocks that
+//                                    may hold pages
+//   stats.decay_purged               bytes purged by the scavenger
+//   stats.classes                    number of memory_classes
+// Commands:
+//   thread.flush    publishes the remote frees of the calling thread and
+//                   gives its large_local_cache to the shared large_cache
+//   trace.dump      writes the trace ring of the calling thread to a file,
+//                   only with MEMORYLIB_TRACE, see trace.h
+//   prof.dump       writes a heap profile, newp may point to the path of the
+//                   file, see the sampling heap profiler
+// Counters of the scavenger:
+//   decay.ms        decay time, 0 is off, it can be written, see decay
+// Counters of the profiler:
+//   prof.rate       average bytes between samples, 0 is off, it can be written
+//   prof.samples    sampled objects that are live
+// Returns 0, ENOENT for an unknown name, EINVAL for wrong arguments or
+// EPERM for writing a counter
+extern "C" int my_mallctl(const char *name, void *oldp, size_t *oldlenp,
+	void *newp, size_t newlen) {
+	if (name == NULL) {
+		return EINVAL;
+	}
+
+	if (strcmp(name, "thread.flush") == 0) {
+		if (oldp != NULL || newp != NULL) {
+			return EINVAL;
+		}
+		if (th != NULL || thread_attach()) {
+			remote_free_flush_all();
+			large_cache_flush(th->large_local_cache, &th->large_local_cache_pages);
+		}
+		return 0;
+	}
+	#ifdef MEMORYLIB_TRACE
+	if (strcmp(name, "trace.dump") == 0) {
+		if (oldp != NULL || newp != NULL) {
+			return EINVAL;
+		}
+		if (th == NULL && !thread_attach()) {
+			return 0;
+		}
+		return trace_dump();
+	}
+	#endif
+	if (strcmp(name, "prof.dump") == 0) {
+		if (oldp != NULL || (newp != NULL && newlen != sizeof(const char*))) {
+			return EINVAL;
 		}
+		return prof_dump(newp != NULL ? *(const char**)newp : NULL);
+	}
+	if (strcmp(name, "prof.rate") == 0 && newp != NULL) {
+		if (oldp != NULL || newlen != sizeof(size_t)) {
+			return EINVAL;
+		}
+		pthread_once(&prof.once, prof_init);
+		prof.rate = *(size_t*)newp;
+		if (th != NULL) {
+			th->prof_countdown = prof_interval(&th->prof_random);
+		}
+		return 0;
+	}
 
-		// Measure the waste/pg for the pointer to the pg_block_header
-		// TODO: Optimization, pointer is 16KB alligned
-		class_info[i].wasted_obj_ptr_per_pg = sizeof(pg_block_header_t *) /
-			class_info[i].memory_size;
-		if (class_info[i].wasted_obj_ptr_per_pg == 0) {
-			class_info[i].wasted_obj_ptr_per_pg = 1;
+	if (strcmp(name, "decay.ms") == 0 && newp != NULL) {
+		if (oldp != NULL || newlen != sizeof(size_t)) {
+			return EINVAL;
 		}
-		// Total waste for all the pgs
-		class_info[i].wasted_obj_ptr_total = class_info[i].wasted_obj_ptr_per_pg *
-			(class_info[i].number_of_pages - 1);
+		decay.ms = *(size_t*)newp;
+		if (decay.ms != 0) {
+			pthread_once(&decay.once, decay_start);
+		}
+		return 0;
+	}
 
-		// Measure how many objects in total are gonna be available in the pg_block
-		class_info[i].obj_in_pg_block -= class_info[i].wasted_obj_pg_header +
-			class_info[i].wasted_obj_ptr_total;
+	size_t value;
+	if (strcmp(name, "stats.mapped") == 0) {
+		value = os_stats.mapped;
+	}
+	else if (strcmp(name, "stats.mmaps") == 0) {
+		value = os_stats.mmaps;
+	}
+	else if (strcmp(name, "stats.munmaps") == 0) {
+		value = os_stats.munmaps;
+	}
+	else if (strcmp(name, "stats.mremaps") == 0) {
+		value = os_stats.mremaps;
+	}
+	else if (strcmp(name, "stats.purges") == 0) {
+		value = os_stats.purges;
+	}
+	else if (strcmp(name, "stats.superblocks") == 0) {
+		value = superblock_manager.superblocks;
+	}
+	else if (strcmp(name, "stats.superblocks_retained") == 0) {
+		value = superblock_manager.retained.size;
+	}
+	else if (strcmp(name, "stats.dirty") == 0) {
+		value = superblock_manager.dirty_units * MIN_PG_BLOCK_SIZE;
+	}
+	else if (strcmp(name, "stats.decay_purged") == 0) {
+		value = decay.purged_units * MIN_PG_BLOCK_SIZE;
+	}
+	else if (strcmp(name, "decay.ms") == 0) {
+		value = decay.ms;
+	}
+	else if (strcmp(name, "stats.classes") == 0) {
+		value = CLASSES;
+	}
+	else if (strcmp(name, "prof.rate") == 0) {
+		pthread_once(&prof.once, prof_init);
+		value = prof.rate;
+	}
+	else if (strcmp(name, "prof.samples") == 0) {
+		value = prof.live_samples;
+	}
+	else {
+		if (strncmp(name, "stats.", strlen("stats.")) != 0) {
+			return ENOENT;
+		}
+		stats_t stats;
+		stats_merge(&stats);
+		if (!stats_read(name, &stats, &value)) {
+			return ENOENT;
+		}
 	}
 
-	// Assign memory_class to cache_class
-	cache_classes = 0;
-	unsigned int pg_block_size = 0;
-	for (int i = 1; i < CLASSES; i++) {
-		global_cache[i] = NULL;
+	if (newp != NULL) {
+		return EPERM;
+	}
+	if (oldp != NULL) {
+		if (oldlenp == NULL || *oldlenp != sizeof(size_t)) {
+			return EINVAL;
+		}
+		*(size_t*)oldp = value;
+	}
+	return 0;
+}
 
-		if (pg_block_size != class_info[i].pg_block_size) {
-			pg_block_size = class_info[i].pg_block_size;
-			cache_classes++;
+// With the following we can define functions to be called when we enter the
+// library for the first time and when we exit the library.
+__attribute__((constructor)) static void initializer(void) {
+	#ifdef MEMORYLIB_DEBUG
+	printf("!!! Library loaded !!!\n");
+	#endif
+	pg_size = getpagesize();
+	#ifdef MEMORYLIB_TRACE
+	trace_start_tsc = trace_tsc();
+	trace_start_ns = trace_ns();
+	#endif
+	pthread_atfork(stats_fork_prepare, stats_fork_parent, stats_fork_child);
+	pthread_atfork(superblock_fork_prepare, superblock_fork_parent,
+		superblock_fork_parent);
+	pthread_once(&prof.once, prof_init);
+	if (prof.rate != 0) {
+		// The first backtrace loads libgcc, better here than in a malloc
+		void *frame;
+		backtrace(&frame, 1);
+	}
+	const char *decay_ms = getenv("MEMORYLIB_DECAY_MS");
+	if (decay_ms != NULL) {
+		decay.ms = strtoul(decay_ms, NULL, 10);
+		if (decay.ms != 0) {
+			pthread_once(&decay.once, decay_start);
 		}
-		class_info[i].cache_class = cache_classes-1;
 	}
 
 	#ifdef MEMORYLIB_DEBUG
@@ -929,11 +4005,6 @@ __attribute__((constructor)) static void initializer(void) {
 	print_global_cache();
 	#endif
 
-	// Allocate the large_obj_table
-	large_obj_table.array = memory_alloc(LARGE_OBJ_TABLE_SIZE);
-	large_obj_table.freed_LIFO = NULL;
-	large_obj_table.unallocated_ptr = large_obj_table.array;
-
 	#ifdef MEMORYLIB_DEBUG
 	printf("\n\n\n\n\n");
 	#endif
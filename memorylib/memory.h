@@ -1,13 +1,29 @@
 #ifndef __MEMORY_H__
 #define __MEMORY_H__
 
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 void *my_malloc(size_t size);
 void my_free(void *ptr);
+void my_free_sized(void *ptr, size_t size);
+void *my_calloc(size_t nmemb, size_t size);
 void *my_realloc(void *ptr, size_t size);
+void *my_aligned_alloc(size_t allignment, size_t size);
+size_t my_malloc_usable_size(void *ptr);
+int my_mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp,
+	size_t newlen);
 void print_less_heap();
 void print_heap();
 void print_local_cache();
 void print_global_cache();
-void print_large_obj_table();
+void print_large_objs();
+
+#ifdef __cplusplus
+}
+#endif
 
 #endif
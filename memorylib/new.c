@@ -0,0 +1,145 @@
+/* Replaces the global operator new and operator delete of C++, so C++
+ * programs linked with libmemory.so or running with libmemory_preload.so
+ * allocate from memorylib
+ * Failures follow the standard, the new_handler is called until it gives
+ * memory back, and std::bad_alloc is thrown if there is none
+ */
+
+#include <new>
+#include "memory.h"
+
+// Objects of new must be aligned for any type of their size, 16B for
+// objects of 16B or more, but the memory_classes of 24B, 40B and 56B are
+// only 8B aligned
+static size_t new_size(size_t size) {
+	if (size == 0) {
+		return 1;
+	}
+	if (size > 8 && size <= (size_t)-16) {
+		return (size + 15) & ~(size_t)15;
+	}
+	return size;
+}
+
+// Allocates size bytes aligned to allignment, 0 for the default alignment
+// Calls the new_handler while there is no memory, throws std::bad_alloc if
+// there is no new_handler
+static void *new_alloc(size_t size, size_t allignment) {
+	while (1) {
+		void *ptr;
+		if (allignment == 0) {
+			ptr = my_malloc(new_size(size));
+		}
+		else {
+			ptr = my_aligned_alloc(allignment, new_size(size));
+		}
+		if (ptr != nullptr) {
+			return ptr;
+		}
+
+		std::new_handler handler = std::get_new_handler();
+		if (handler == nullptr) {
+			throw std::bad_alloc();
+		}
+		handler();
+	}
+}
+
+// Same as new_alloc, but returns nullptr instead of throwing
+static void *new_alloc_nothrow(size_t size, size_t allignment) noexcept {
+	try {
+		return new_alloc(size, allignment);
+	}
+	catch (...) {
+		return nullptr;
+	}
+}
+
+/*---------- operator new ----------*/
+void *operator new(size_t size) {
+	return new_alloc(size, 0);
+}
+
+void *operator new[](size_t size) {
+	return new_alloc(size, 0);
+}
+
+void *operator new(size_t size, const std::nothrow_t&) noexcept {
+	return new_alloc_nothrow(size, 0);
+}
+
+void *operator new[](size_t size, const std::nothrow_t&) noexcept {
+	return new_alloc_nothrow(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t allignment) {
+	return new_alloc(size, (size_t)allignment);
+}
+
+void *operator new[](size_t size, std::align_val_t allignment) {
+	return new_alloc(size, (size_t)allignment);
+}
+
+void *operator new(size_t size, std::align_val_t allignment,
+	const std::nothrow_t&) noexcept {
+	return new_alloc_nothrow(size, (size_t)allignment);
+}
+
+void *operator new[](size_t size, std::align_val_t allignment,
+	const std::nothrow_t&) noexcept {
+	return new_alloc_nothrow(size, (size_t)allignment);
+}
+
+/*---------- operator delete ----------*/
+// Sized deletes find the pg_block from the size, my_free_sized knows memory
+// of the bootstrap arena, from new while a thread is set up or torn down, by
+// its range. Aligned objects always need my_free
+void operator delete(void *ptr) noexcept {
+	my_free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept {
+	my_free(ptr);
+}
+
+void operator delete(void *ptr, size_t size) noexcept {
+	my_free_sized(ptr, new_size(size));
+}
+
+void operator delete[](void *ptr, size_t size) noexcept {
+	my_free_sized(ptr, new_size(size));
+}
+
+void operator delete(void *ptr, const std::nothrow_t&) noexcept {
+	my_free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t&) noexcept {
+	my_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept {
+	my_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept {
+	my_free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept {
+	my_free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept {
+	my_free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t,
+	const std::nothrow_t&) noexcept {
+	my_free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t,
+	const std::nothrow_t&) noexcept {
+	my_free(ptr);
+}
@@ -0,0 +1,120 @@
+/* Compiled with memory.c to libmemory_preload.so, which replaces the
+ * allocation functions of libc, e.g.
+ * LD_PRELOAD=path/libmemory_preload.so program
+ * memory.c is compiled with MEMORYLIB_PRELOAD, so it doesn't print on the
+ * allocation path
+ */
+
+#include <stdlib.h>
+#include <malloc.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "memory.h"
+
+// malloc has to return memory aligned for any type, 16B for objects of 16B
+// or more, but the memory_classes of 24B, 40B and 56B are only 8B aligned
+static size_t preload_size(size_t size) {
+	if (size == 0) {
+		return 1;
+	}
+	if (size > 8 && size <= (size_t)-16) {
+		return (size + 15) & ~(size_t)15;
+	}
+	return size;
+}
+
+static int is_power_of_two(size_t x) {
+	return x != 0 && (x & (x - 1)) == 0;
+}
+
+extern "C" void *malloc(size_t size) __THROW {
+	void *ptr = my_malloc(preload_size(size));
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+extern "C" void free(void *ptr) __THROW {
+	my_free(ptr);
+}
+
+extern "C" void *calloc(size_t nmemb, size_t size) __THROW {
+	if (size != 0 && nmemb > (size_t)-1 / size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	void *ptr = my_calloc(1, preload_size(nmemb * size));
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+extern "C" void *realloc(void *ptr, size_t size) __THROW {
+	if (ptr != NULL && size == 0) {
+		my_free(ptr);
+		return NULL;
+	}
+	void *obj = my_realloc(ptr, preload_size(size));
+	if (obj == NULL) {
+		errno = ENOMEM;
+	}
+	return obj;
+}
+
+extern "C" int posix_memalign(void **memptr, size_t alignment, size_t size)
+	__THROW {
+	if (!is_power_of_two(alignment) || alignment % sizeof(void*) != 0) {
+		return EINVAL;
+	}
+	void *ptr = my_aligned_alloc(alignment, preload_size(size));
+	if (ptr == NULL) {
+		return ENOMEM;
+	}
+	*memptr = ptr;
+	return 0;
+}
+
+extern "C" void *aligned_alloc(size_t alignment, size_t size) __THROW {
+	if (!is_power_of_two(alignment)) {
+		errno = EINVAL;
+		return NULL;
+	}
+	void *ptr = my_aligned_alloc(alignment, preload_size(size));
+	if (ptr == NULL) {
+		errno = ENOMEM;
+	}
+	return ptr;
+}
+
+extern "C" void *memalign(size_t alignment, size_t size) __THROW {
+	// Like glibc, round the alignment up to a power of two
+	size_t power = 1;
+	while (power < alignment && power != 0) {
+		power <<= 1;
+	}
+	if (power == 0) {
+		errno = EINVAL;
+		return NULL;
+	}
+	return aligned_alloc(power, size);
+}
+
+extern "C" void *valloc(size_t size) __THROW {
+	return aligned_alloc(getpagesize(), size);
+}
+
+extern "C" void *pvalloc(size_t size) __THROW {
+	size_t pg_size = getpagesize();
+	if (size > (size_t)-1 - pg_size) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	return aligned_alloc(pg_size, (size + pg_size - 1) & ~(pg_size - 1));
+}
+
+extern "C" size_t malloc_usable_size(void *ptr) __THROW {
+	return my_malloc_usable_size(ptr);
+}
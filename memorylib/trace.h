@@ -0,0 +1,77 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+/* Binary event trace of memorylib, shared by the library and trace_decode
+ * memory.c compiled with MEMORYLIB_TRACE keeps the last TRACE_EVENTS events
+ * of every thread in a ring, only the thread writes to it. The ring is
+ * dumped to memorylib.<pid>.<tid>.trace, in MEMORYLIB_TRACE_DIR or in the
+ * current directory, when the thread ends or with my_mallctl("trace.dump")
+ */
+
+#define TRACE_MAGIC 0x3145434152544c4dUL	// "MLTRACE1"
+#define TRACE_EVENTS 65536								// Must be a power of two
+
+#define TRACE_ALLOC 0					// ptr: object, arg: 0
+#define TRACE_FREE 1					// ptr: object, arg: 0
+#define TRACE_REMOTE_FREE 2		// ptr: object, arg: 0
+#define TRACE_REMOTE_FLUSH 3	// ptr: pg_block, arg: objects published
+#define TRACE_LARGE_ALLOC 4		// ptr: object, arg: pages
+#define TRACE_LARGE_FREE 5		// ptr: object, arg: pages
+#define TRACE_BLOCK_ALLOC 6		// ptr: pg_block, arg: TRACE_FROM_*
+#define TRACE_BLOCK_FREE 7		// ptr: pg_block, arg: TRACE_TO_*
+#define TRACE_ADOPT 8					// ptr: pg_block, arg: 0
+#define TRACE_CACHE_FLUSH 9		// ptr: NULL, arg: pages given to large_cache
+#define TRACE_CAS_RETRY 10		// ptr: contended address, arg: 0
+#define TRACE_TYPES 11
+
+// Where a pg_block comes from and where it goes to
+#define TRACE_LOCAL_CACHE 0
+#define TRACE_GLOBAL_CACHE 1
+#define TRACE_OS 2						// A superblock, memory from the OS
+
+#define TRACE_NO_CLASS 255
+
+struct trace_event {
+	unsigned long long tsc;
+	unsigned long ptr;
+	unsigned long info;		// type: 8 bits, memory_class: 8 bits, arg: 48 bits
+};
+typedef struct trace_event trace_event_t;
+
+// Start of a dump, the events follow from the oldest to the newest
+// The two clock readings let the decoder convert tsc to time
+struct trace_header {
+	unsigned long magic;
+	unsigned long tid;
+	unsigned long events;
+	unsigned long long start_tsc;		// When the library was loaded
+	unsigned long long start_ns;
+	unsigned long long dump_tsc;		// When the dump was written
+	unsigned long long dump_ns;
+};
+typedef struct trace_header trace_header_t;
+
+static inline unsigned long trace_info(unsigned int type,
+	unsigned int memory_class, unsigned long arg) {
+	return type | ((unsigned long)memory_class << 8) | (arg << 16);
+}
+
+static inline unsigned int trace_type(unsigned long info) {
+	return info & 0xff;
+}
+
+static inline unsigned int trace_class(unsigned long info) {
+	return (info >> 8) & 0xff;
+}
+
+static inline unsigned long trace_arg(unsigned long info) {
+	return info >> 16;
+}
+
+static inline unsigned long long trace_tsc() {
+	unsigned int low, high;
+	asm volatile("rdtsc" : "=a" (low), "=d" (high));
+	return ((unsigned long long)high << 32) | low;
+}
+
+#endif
@@ -0,0 +1,165 @@
+/* Decodes the trace dumps of memorylib, see trace.h
+ * Usage: trace_decode [-s] memorylib.<pid>.<tid>.trace...
+ * Prints the events of all the dumps as one timeline, in µs since the
+ * library was loaded, followed by the events of every thread by type
+ * -s prints only the summary
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "trace.h"
+
+#define handle_error(msg) { fprintf(stderr, "trace_decode: %s\n", msg); exit(EXIT_FAILURE); }
+
+const char *type_name[TRACE_TYPES] = {"alloc", "free", "remote_free",
+	"remote_flush", "large_alloc", "large_free", "block_alloc", "block_free",
+	"adopt", "cache_flush", "cas_retry"};
+const char *cache_name[] = {"local_cache", "global_cache", "os"};
+
+struct dump {
+	trace_header_t header;
+	trace_event_t *event;
+	double tsc_per_us;
+	unsigned long next;									// Next event of the timeline
+	unsigned long count[TRACE_TYPES];
+};
+typedef struct dump dump_t;
+
+// Reads a dump, the events are in order from the oldest to the newest
+void read_dump(const char *path, dump_t *dump) {
+	FILE *file = fopen(path, "rb");
+	if (file == NULL) {
+		fprintf(stderr, "trace_decode: can't open %s\n", path);
+		exit(EXIT_FAILURE);
+	}
+	if (fread(&dump->header, sizeof(trace_header_t), 1, file) != 1 ||
+		dump->header.magic != TRACE_MAGIC) {
+		fprintf(stderr, "trace_decode: %s is not a memorylib trace\n", path);
+		exit(EXIT_FAILURE);
+	}
+	dump->event = (trace_event_t*)malloc(dump->header.events *
+		sizeof(trace_event_t));
+	if (dump->event == NULL) { handle_error("malloc failed"); }
+	if (fread(dump->event, sizeof(trace_event_t), dump->header.events, file) !=
+		dump->header.events) {
+		fprintf(stderr, "trace_decode: %s is truncated\n", path);
+		exit(EXIT_FAILURE);
+	}
+	fclose(file);
+
+	// The tsc rate between the library load and the dump
+	unsigned long long ns = dump->header.dump_ns - dump->header.start_ns;
+	if (ns == 0) {
+		ns = 1;
+	}
+	dump->tsc_per_us = (double)(dump->header.dump_tsc - dump->header.start_tsc)
+		* 1000 / ns;
+	if (dump->tsc_per_us <= 0) {
+		dump->tsc_per_us = 1;
+	}
+	dump->next = 0;
+	memset(dump->count, 0, sizeof(dump->count));
+}
+
+double event_us(dump_t *dump, trace_event_t *event) {
+	return (double)(long long)(event->tsc - dump->header.start_tsc) /
+		dump->tsc_per_us;
+}
+
+void print_event(dump_t *dump, trace_event_t *event) {
+	unsigned int type = trace_type(event->info);
+	unsigned int memory_class = trace_class(event->info);
+	unsigned long arg = trace_arg(event->info);
+
+	printf("%14.3f  %7lu  %-12s  %#14lx", event_us(dump, event),
+		dump->header.tid, type < TRACE_TYPES ? type_name[type] : "unknown",
+		event->ptr);
+	if (memory_class != TRACE_NO_CLASS) {
+		printf("  class: %2u", memory_class);
+	}
+	switch (type) {
+		case TRACE_REMOTE_FLUSH:
+			printf("  objects: %lu", arg);
+			break;
+		case TRACE_LARGE_ALLOC:
+		case TRACE_LARGE_FREE:
+		case TRACE_CACHE_FLUSH:
+			printf("  pages: %lu", arg);
+			break;
+		case TRACE_BLOCK_ALLOC:
+			printf("  from: %s", arg <= TRACE_OS ? cache_name[arg] : "unknown");
+			break;
+		case TRACE_BLOCK_FREE:
+			printf("  to: %s", arg <= TRACE_OS ? cache_name[arg] : "unknown");
+			break;
+	}
+	printf("\n");
+}
+
+int main(int argc, char *argv[]) {
+	int summary_only = 0;
+	int first = 1;
+	if (argc > 1 && strcmp(argv[1], "-s") == 0) {
+		summary_only = 1;
+		first = 2;
+	}
+	if (first >= argc) {
+		fprintf(stderr, "Usage: %s [-s] memorylib.<pid>.<tid>.trace...\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	int dumps = argc - first;
+	dump_t *dump = (dump_t*)malloc(dumps * sizeof(dump_t));
+	if (dump == NULL) { handle_error("malloc failed"); }
+	for (int i = 0; i < dumps; i++) {
+		read_dump(argv[first + i], &dump[i]);
+	}
+
+	// Merge the dumps by time, every dump is already in order
+	if (!summary_only) {
+		printf("%14s  %7s  %-12s  %14s\n", "time (us)", "tid", "event", "ptr");
+	}
+	while (1) {
+		int next = -1;
+		double next_us = 0;
+		for (int i = 0; i < dumps; i++) {
+			if (dump[i].next == dump[i].header.events) {
+				continue;
+			}
+			double us = event_us(&dump[i], &dump[i].event[dump[i].next]);
+			if (next == -1 || us < next_us) {
+				next = i;
+				next_us = us;
+			}
+		}
+		if (next == -1) {
+			break;
+		}
+		trace_event_t *event = &dump[next].event[dump[next].next++];
+		if (trace_type(event->info) < TRACE_TYPES) {
+			dump[next].count[trace_type(event->info)]++;
+		}
+		if (!summary_only) {
+			print_event(&dump[next], event);
+		}
+	}
+
+	// Events of every thread by type
+	printf("\n%7s", "tid");
+	for (int type = 0; type < TRACE_TYPES; type++) {
+		printf("  %s", type_name[type]);
+	}
+	printf("\n");
+	for (int i = 0; i < dumps; i++) {
+		printf("%7lu", dump[i].header.tid);
+		for (int type = 0; type < TRACE_TYPES; type++) {
+			printf("  %*lu", (int)strlen(type_name[type]), dump[i].count[type]);
+		}
+		printf("\n");
+		free(dump[i].event);
+	}
+	free(dump);
+
+	return 0;
+}